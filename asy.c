@@ -0,0 +1,195 @@
+// ============================================================================
+// asy.c - asynchronous file IO
+//
+// asySubmit queues a batch of tagged read/write requests and returns at
+// once.  A pool of worker threads takes requests off the submission queue
+// and runs each as an fsPread or fsPwrite, so many transfers are in flight
+// together, each under its file's Inode lock.  Each finished request goes
+// on the completion queue, with its tag, for asyPoll or asyWait to collect.
+// At most ASYQDEPTH requests are queued, running or waiting collection at
+// once; asySubmit accepts what fits.  Requests complete in any order
+// ============================================================================
+
+#include <pthread.h>
+
+#include "asy.h"
+#include "bfs.h"
+#include "fs.h"
+
+static AsyReq  g_sq[ASYQDEPTH];          // submission ring
+static i32     g_sqHead = 0;             // oldest request in 'g_sq'
+static i32     g_sqCount = 0;            // # of requests in 'g_sq'
+static AsyDone g_cq[ASYQDEPTH];          // completion ring
+static i32     g_cqHead = 0;             // oldest completion in 'g_cq'
+static i32     g_cqCount = 0;            // # of completions in 'g_cq'
+static i32     g_busy = 0;               // # of requests workers are running
+static i32     g_open = 0;               // 1 => accepting requests
+
+static pthread_t g_workers[ASYMAXWORKERS];
+static i32       g_numWorkers = 0;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards all above
+static pthread_cond_t  g_work = PTHREAD_COND_INITIALIZER;  // request queued
+static pthread_cond_t  g_done = PTHREAD_COND_INITIALIZER;  // request finished
+
+// ============================================================================
+// Move up to 'max' completions into 'done'.  Return how many.  Caller holds
+// g_lock
+// ============================================================================
+static i32 asyReap(AsyDone* done, i32 max) {
+  i32 n = 0;
+  while (n < max && g_cqCount > 0) {
+    done[n++] = g_cq[g_cqHead];
+    g_cqHead = (g_cqHead + 1) % ASYQDEPTH;
+    --g_cqCount;
+  }
+  return n;
+}
+
+
+
+// ============================================================================
+// Body of each worker thread: run requests until asyClose, once the
+// submission queue is empty
+// ============================================================================
+static void* asyWorker(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&g_lock);
+  for (;;) {
+    while (g_open && g_sqCount == 0) pthread_cond_wait(&g_work, &g_lock);
+    if (g_sqCount == 0) break;                  // closed, and drained
+
+    AsyReq req = g_sq[g_sqHead];
+    g_sqHead = (g_sqHead + 1) % ASYQDEPTH;
+    --g_sqCount;
+    ++g_busy;
+    pthread_mutex_unlock(&g_lock);
+
+    AsyDone done;
+    done.tag = req.tag;
+    done.op  = req.op;
+    if (req.op == ASYREAD) {
+      done.ret = fsPread (req.fd, req.numb, req.buf, req.offset);
+    } else {
+      done.ret = fsPwrite(req.fd, req.numb, req.buf, req.offset);
+    }
+
+    // The in-flight limit leaves room on the completion queue
+
+    pthread_mutex_lock(&g_lock);
+    --g_busy;
+    g_cq[(g_cqHead + g_cqCount) % ASYQDEPTH] = done;
+    ++g_cqCount;
+    pthread_cond_broadcast(&g_done);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Stop accepting requests, let the workers finish every request already
+// submitted, then stop them.  Completions not yet collected are dropped.
+// Call before fsUnmount.  Safe to call if not started
+// ============================================================================
+i32 asyClose() {
+  pthread_mutex_lock(&g_lock);
+  if (!g_open) { pthread_mutex_unlock(&g_lock); return 0; }
+  g_open = 0;
+  pthread_cond_broadcast(&g_work);
+  pthread_mutex_unlock(&g_lock);
+
+  for (i32 i = 0; i < g_numWorkers; ++i) pthread_join(g_workers[i], NULL);
+  g_numWorkers = 0;
+  g_cqHead = g_cqCount = 0;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Start 'numWorkers' worker threads (ASYWORKERS if 'numWorkers' <= 0) on
+// the mounted disk.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 asyInit(i32 numWorkers) {
+  if (numWorkers <= 0)            numWorkers = ASYWORKERS;
+  if (numWorkers > ASYMAXWORKERS) numWorkers = ASYMAXWORKERS;
+
+  asyClose();
+
+  pthread_mutex_lock(&g_lock);
+  g_sqHead = g_sqCount = 0;
+  g_cqHead = g_cqCount = 0;
+  g_busy = 0;
+  g_open = 1;
+  pthread_mutex_unlock(&g_lock);
+
+  for (i32 i = 0; i < numWorkers; ++i) {
+    i32 ret = pthread_create(&g_workers[i], NULL, asyWorker, NULL);
+    if (ret != 0) FATAL(ENOMEM);
+    ++g_numWorkers;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Move up to 'max' completions into 'done', without waiting.  Return how
+// many
+// ============================================================================
+i32 asyPoll(AsyDone* done, i32 max) {
+  return asyWait(done, 0, max);
+}
+
+
+
+// ============================================================================
+// Queue the 'n' requests in 'reqs'.  The caller keeps each 'buf' untouched
+// until its request completes.  Return how many requests, from the front
+// of 'reqs', were accepted: fewer than 'n' if ASYQDEPTH would be exceeded.
+// On failure, abort
+// ============================================================================
+i32 asySubmit(AsyReq* reqs, i32 n) {
+  if (reqs == NULL) FATAL(ENULLPTR);
+  for (i32 i = 0; i < n; ++i) {
+    if (reqs[i].op != ASYREAD && reqs[i].op != ASYWRITE) FATAL(EBADASY);
+    if (reqs[i].buf == NULL)                             FATAL(ENULLPTR);
+  }
+
+  pthread_mutex_lock(&g_lock);
+  if (!g_open) FATAL(EBADASY);
+
+  i32 room = ASYQDEPTH - (g_sqCount + g_busy + g_cqCount);
+  if (n > room) n = room;
+  for (i32 i = 0; i < n; ++i) {
+    g_sq[(g_sqHead + g_sqCount) % ASYQDEPTH] = reqs[i];
+    ++g_sqCount;
+  }
+  if (n > 0) pthread_cond_broadcast(&g_work);
+  pthread_mutex_unlock(&g_lock);
+  return n;
+}
+
+
+
+// ============================================================================
+// Wait until at least 'min' requests have completed, or every request in
+// flight has, then move up to 'max' completions into 'done'.  Return how
+// many
+// ============================================================================
+i32 asyWait(AsyDone* done, i32 min, i32 max) {
+  if (done == NULL && max > 0) FATAL(ENULLPTR);
+  if (min > max) min = max;
+
+  pthread_mutex_lock(&g_lock);
+  for (;;) {
+    i32 inflight = g_sqCount + g_busy + g_cqCount;
+    if (g_cqCount >= min || g_cqCount == inflight) break;
+    pthread_cond_wait(&g_done, &g_lock);
+  }
+  i32 n = asyReap(done, max);
+  pthread_mutex_unlock(&g_lock);
+  return n;
+}
@@ -0,0 +1,39 @@
+#ifndef ASY_H
+#define ASY_H
+
+// ===================================================================
+// asy.h - asynchronous file IO: a submission queue of tagged
+// requests, run by a pool of worker threads, and a completion queue
+// ===================================================================
+
+#include "alias.h"
+
+#define ASYREAD       1           // AsyReq ops
+#define ASYWRITE      2
+
+#define ASYQDEPTH     256         // most requests in flight at once
+#define ASYWORKERS    4           // default # of worker threads
+#define ASYMAXWORKERS 32
+
+typedef struct {          // one request, as submitted
+  i32   op;               // ASYREAD or ASYWRITE
+  i32   fd;               // File Descriptor to transfer on
+  i32   numb;             // # of bytes to transfer
+  i32   offset;           // byte offset into the file
+  void* buf;              // where to read into, or data to write
+  u64   tag;              // caller's tag, handed back in the AsyDone
+} AsyReq;
+
+typedef struct {          // one completed request
+  u64 tag;                // AsyReq.tag
+  i32 op;                 // AsyReq.op
+  i32 ret;                // what fsPread or fsPwrite returned
+} AsyDone;
+
+i32 asyClose ();
+i32 asyInit  (i32 numWorkers);
+i32 asyPoll  (AsyDone* done, i32 max);
+i32 asySubmit(AsyReq* reqs, i32 n);
+i32 asyWait  (AsyDone* done, i32 min, i32 max);
+
+#endif
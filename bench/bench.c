@@ -0,0 +1,391 @@
+// ============================================================================
+// bench.c - throughput and latency benchmark suite for BFS
+//
+// Runs a set of single threaded workloads, each on a freshly formatted
+// disk: sequential and random reads and writes at several request sizes,
+// create and lookup storms, many small appends, metadata churn, and a sweep
+// over file sizes.  Every fs* call (or, for the storms, every create, open
+// or create-write-delete cycle) is timed on its own.  Prints one CSV row
+// per workload and size: throughput in MB/s and ops/s, and the 50th and
+// 99th percentile latency.  Name workloads on the command line to run only
+// those; with none, all run
+// ============================================================================
+
+#include <time.h>
+
+#include "../bfs.h"
+#include "../fs.h"
+#include "../prf.h"
+
+#define BLOCKSIZE   4096
+#define DISKBLOCKS  (96 * 1024)           // 384 MB disk
+#define DISKINODES  4096
+
+#define FILEBYTES   (64 * 1024 * 1024)    // file for the seq/rand workloads
+#define RANDOPS     4096                  // requests per random workload
+#define NUMFILES    2000                  // files in the storm workloads
+#define APPENDFILES 16                    // files appended to in turn
+#define APPENDBYTES (256 * 1024)          // bytes appended to each
+#define METAOPS     2000                  // create-write-delete cycles
+#define SWEEPBYTES  (64 * 1024 * 1024)    // bytes written per file size
+#define SWEEPFILES  256                   // most files per file size
+#define MAXREQ      (1024 * 1024)         // largest request, in bytes
+#define MAXSAMPLES  (128 * 1024)          // most latencies kept per row
+
+static u64    g_ns[MAXSAMPLES];           // latency of each op in this row
+static i64    g_n  = 0;                   // # of entries in 'g_ns'
+static double g_t0 = 0;                   // when this row started
+static u64    g_rand = 88172645463325252ull; // xorshift state: same each run
+static i8*    g_buf = NULL;               // MAXREQ bytes of file data
+
+// ============================================================================
+// Compare two latencies, for qsort
+// ============================================================================
+static int cmpU64(const void* a, const void* b) {
+  u64 x = *(const u64*)a;
+  u64 y = *(const u64*)b;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Nanoseconds since some fixed point, from the monotonic clock
+// ============================================================================
+static u64 nsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Next pseudo random number: xorshift64, so every run does the same IO
+// ============================================================================
+static u64 nextRand() {
+  g_rand ^= g_rand << 13;
+  g_rand ^= g_rand >> 7;
+  g_rand ^= g_rand << 17;
+  return g_rand;
+}
+
+
+
+// ============================================================================
+// Note that an op started at 'ns', as returned by nsNow, just finished
+// ============================================================================
+static void lap(u64 ns) {
+  if (g_n < MAXSAMPLES) g_ns[g_n++] = nsNow() - ns;
+}
+
+
+
+// ============================================================================
+// Start a fresh disk, and the clock for the next row
+// ============================================================================
+static void start() {
+  fsFormat(DISKBLOCKS, BLOCKSIZE, DISKINODES);
+  fsMount();
+  g_n  = 0;
+  g_t0 = nsNow() / 1e9;
+}
+
+
+
+// ============================================================================
+// Print the row for workload 'name', whose ops moved 'bytes' in total, then
+// unmount its disk.  'req' is the request size and 'file' the file size, in
+// bytes, or 0 if they do not apply
+// ============================================================================
+static void report(str name, i32 req, i32 file, i64 bytes) {
+  double secs = nsNow() / 1e9 - g_t0;
+  qsort(g_ns, g_n, sizeof(u64), cmpU64);
+  double p50 = g_n ? g_ns[(g_n - 1) * 50 / 100] / 1e3 : 0;
+  double p99 = g_n ? g_ns[(g_n - 1) * 99 / 100] / 1e3 : 0;
+
+  printf("%s,%d,%d,%lld,%.3f,%.1f,%.0f,%.2f,%.2f\n", name, req, file,
+    (long long)g_n, secs, bytes / secs / (1024 * 1024), g_n / secs, p50, p99);
+  fflush(stdout);
+  fsUnmount();
+}
+
+
+
+// ============================================================================
+// Write FILEBYTES to a new file named 'fname', MAXREQ at a time, untimed.
+// Return its fd
+// ============================================================================
+static i32 fill(str fname) {
+  i32 fd = fsCreate(fname);
+  for (i32 off = 0; off < FILEBYTES; off += MAXREQ) {
+    fsWrite(fd, MAXREQ, g_buf);
+  }
+  fsSync();
+  return fd;
+}
+
+
+
+// ============================================================================
+// Append 'req' bytes at a time, in turn, to each of APPENDFILES files
+// ============================================================================
+static void benchAppend(i32 req) {
+  start();
+  i32 fd[APPENDFILES];
+  for (i32 i = 0; i < APPENDFILES; ++i) {
+    char fname[FNAMESIZE];
+    sprintf(fname, "app%d", i);
+    fd[i] = fsCreate(fname);
+  }
+
+  for (i32 off = 0; off < APPENDBYTES; off += req) {
+    for (i32 i = 0; i < APPENDFILES; ++i) {
+      u64 t = nsNow();
+      fsWrite(fd[i], req, g_buf);
+      lap(t);
+    }
+  }
+  fsSync();
+
+  for (i32 i = 0; i < APPENDFILES; ++i) fsClose(fd[i]);
+  report("append", req, APPENDBYTES, (i64)APPENDFILES * APPENDBYTES);
+}
+
+
+
+// ============================================================================
+// Create NUMFILES empty files, closing each; then open and close each of
+// them again, in random order
+// ============================================================================
+static void benchCreate() {
+  start();
+  for (i32 i = 0; i < NUMFILES; ++i) {
+    char fname[FNAMESIZE];
+    sprintf(fname, "f%d", i);
+    u64 t = nsNow();
+    fsClose(fsCreate(fname));
+    lap(t);
+  }
+  fsSync();
+  report("create", 0, 0, 0);
+
+  fsMount();                               // same files, fresh clock
+  g_n  = 0;
+  g_t0 = nsNow() / 1e9;
+  for (i32 i = 0; i < NUMFILES; ++i) {
+    char fname[FNAMESIZE];
+    sprintf(fname, "f%d", (i32)(nextRand() % NUMFILES));
+    u64 t = nsNow();
+    fsClose(fsOpen(fname));
+    lap(t);
+  }
+  report("lookup", 0, 0, 0);
+}
+
+
+
+// ============================================================================
+// METAOPS cycles of: create a file, write one block, shrink it to half a
+// block, close it and delete it.  Each cycle is one op
+// ============================================================================
+static void benchMeta() {
+  start();
+  for (i32 i = 0; i < METAOPS; ++i) {
+    char fname[FNAMESIZE];
+    sprintf(fname, "m%d", i % 64);
+    u64 t = nsNow();
+    i32 fd = fsCreate(fname);
+    fsWrite(fd, BLOCKSIZE, g_buf);
+    fsTruncate(fd, BLOCKSIZE / 2);
+    fsClose(fd);
+    fsDelete(fname);
+    lap(t);
+  }
+  fsSync();
+  report("meta", BLOCKSIZE, 0, (i64)METAOPS * BLOCKSIZE);
+}
+
+
+
+// ============================================================================
+// Read 'req' bytes at a time from random, 'req' aligned offsets in a
+// FILEBYTES file
+// ============================================================================
+static void benchRandRead(i32 req) {
+  start();
+  i32 fd = fill("rand");
+  g_n  = 0;
+  g_t0 = nsNow() / 1e9;
+
+  for (i32 i = 0; i < RANDOPS; ++i) {
+    i32 off = (i32)(nextRand() % (FILEBYTES / req)) * req;
+    u64 t = nsNow();
+    fsPread(fd, req, g_buf, off);
+    lap(t);
+  }
+
+  fsClose(fd);
+  report("randread", req, FILEBYTES, (i64)RANDOPS * req);
+}
+
+
+
+// ============================================================================
+// Overwrite 'req' bytes at a time at random, 'req' aligned offsets in a
+// FILEBYTES file.  The closing fsSync counts toward the time taken
+// ============================================================================
+static void benchRandWrite(i32 req) {
+  start();
+  i32 fd = fill("rand");
+  g_n  = 0;
+  g_t0 = nsNow() / 1e9;
+
+  for (i32 i = 0; i < RANDOPS; ++i) {
+    i32 off = (i32)(nextRand() % (FILEBYTES / req)) * req;
+    u64 t = nsNow();
+    fsPwrite(fd, req, g_buf, off);
+    lap(t);
+  }
+  fsSync();
+
+  fsClose(fd);
+  report("randwrite", req, FILEBYTES, (i64)RANDOPS * req);
+}
+
+
+
+// ============================================================================
+// Read a FILEBYTES file from start to end, 'req' bytes at a time
+// ============================================================================
+static void benchSeqRead(i32 req) {
+  start();
+  fsClose(fill("seq"));
+  fsUnmount();                             // start with a cold buffer cache
+  fsMount();
+  g_n  = 0;
+  g_t0 = nsNow() / 1e9;
+
+  i32 fd = fsOpen("seq");
+  for (i32 off = 0; off < FILEBYTES; off += req) {
+    u64 t = nsNow();
+    fsRead(fd, req, g_buf);
+    lap(t);
+  }
+
+  fsClose(fd);
+  report("seqread", req, FILEBYTES, FILEBYTES);
+}
+
+
+
+// ============================================================================
+// Write a new FILEBYTES file from start to end, 'req' bytes at a time.  The
+// closing fsSync counts toward the time taken
+// ============================================================================
+static void benchSeqWrite(i32 req) {
+  start();
+  i32 fd = fsCreate("seq");
+  for (i32 off = 0; off < FILEBYTES; off += req) {
+    u64 t = nsNow();
+    fsWrite(fd, req, g_buf);
+    lap(t);
+  }
+  fsSync();
+
+  fsClose(fd);
+  report("seqwrite", req, FILEBYTES, FILEBYTES);
+}
+
+
+
+// ============================================================================
+// Write, then read back, files of 'size' bytes: as many as fit in
+// SWEEPBYTES, up to SWEEPFILES.  Each op creates (or opens) one file, moves
+// all of it, 64 KB at a time, and closes it
+// ============================================================================
+static void benchSweep(i32 size) {
+  i32 files = SWEEPBYTES / size;
+  if (files > SWEEPFILES) files = SWEEPFILES;
+  i32 req = size < 65536 ? size : 65536;
+
+  start();
+  for (i32 i = 0; i < files; ++i) {
+    char fname[FNAMESIZE];
+    sprintf(fname, "s%d", i);
+    u64 t = nsNow();
+    i32 fd = fsCreate(fname);
+    for (i32 off = 0; off < size; off += req) fsWrite(fd, req, g_buf);
+    fsClose(fd);
+    lap(t);
+  }
+  fsSync();
+  report("sweepwrite", req, size, (i64)files * size);
+
+  fsMount();                               // same files, cold cache
+  g_n  = 0;
+  g_t0 = nsNow() / 1e9;
+  for (i32 i = 0; i < files; ++i) {
+    char fname[FNAMESIZE];
+    sprintf(fname, "s%d", i);
+    u64 t = nsNow();
+    i32 fd = fsOpen(fname);
+    for (i32 off = 0; off < size; off += req) fsRead(fd, req, g_buf);
+    fsClose(fd);
+    lap(t);
+  }
+  report("sweepread", req, size, (i64)files * size);
+}
+
+
+
+// ============================================================================
+// Return 1 if workload 'name' should run: it was named on the command
+// line, or nothing was
+// ============================================================================
+static i32 wanted(str name, int argc, char** argv) {
+  if (argc < 2) return 1;
+  for (i32 i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], name) == 0) return 1;
+  }
+  return 0;
+}
+
+
+
+int main(int argc, char** argv) {
+  g_buf = malloc(MAXREQ);
+  if (g_buf == NULL) FATAL(ENOMEM);
+  memset(g_buf, 'b', MAXREQ);
+
+  prfEnable(PRFOFF);                       // time BFS, not its counters
+
+  i32 sizes[] = { 512, 4096, 65536, MAXREQ };
+  i32 files[] = { 4096, 65536, 1024 * 1024, 16 * 1024 * 1024 };
+
+  printf("workload,req_bytes,file_bytes,ops,secs,mb_s,ops_s,p50_us,p99_us\n");
+
+  for (i32 i = 0; i < 4; ++i) {
+    if (wanted("seqwrite", argc, argv)) benchSeqWrite(sizes[i]);
+  }
+  for (i32 i = 0; i < 4; ++i) {
+    if (wanted("seqread", argc, argv)) benchSeqRead(sizes[i]);
+  }
+  for (i32 i = 1; i < 3; ++i) {
+    if (wanted("randwrite", argc, argv)) benchRandWrite(sizes[i]);
+  }
+  for (i32 i = 1; i < 3; ++i) {
+    if (wanted("randread", argc, argv)) benchRandRead(sizes[i]);
+  }
+  if (wanted("create", argc, argv)) benchCreate();
+  for (i32 i = 0; i < 2; ++i) {
+    if (wanted("append", argc, argv)) benchAppend(sizes[i]);
+  }
+  if (wanted("meta", argc, argv)) benchMeta();
+  for (i32 i = 0; i < 4; ++i) {
+    if (wanted("sweep", argc, argv)) benchSweep(files[i]);
+  }
+
+  free(g_buf);
+  return 0;
+}
@@ -0,0 +1,43 @@
+// ============================================================================
+// replay.c - replay a trace of fs* calls against BFSDISK
+//
+// Usage: replay [-p] [-v] TRACE
+//
+// Makes every call recorded in TRACE again, as fast as possible, or with
+// -p at the pace they were recorded.  The trace is recorded by running any
+// BFS program with BFSTRACE set to a path.  Prints, as CSV, how many calls
+// were replayed, how many returned other than recorded, and how long they
+// took, now and when recorded.  With -v, then dumps the performance
+// counters of the replay
+// ============================================================================
+
+#include "../bfs.h"
+#include "../deb.h"
+#include "../trc.h"
+
+int main(int argc, char** argv) {
+  i32 paced = 0;
+  i32 verbose = 0;
+  str path = NULL;
+  for (i32 i = 1; i < argc; ++i) {
+    if      (strcmp(argv[i], "-p") == 0) paced = 1;
+    else if (strcmp(argv[i], "-v") == 0) verbose = 1;
+    else                                 path = argv[i];
+  }
+  if (path == NULL) {
+    fprintf(stderr, "usage: replay [-p] [-v] TRACE\n");
+    return 1;
+  }
+
+  unsetenv(TRCENV);                        // do not trace the replay
+
+  TrcStats st;
+  trcReplay(path, paced, &st);
+
+  printf("calls,differ,secs,trace_secs,ops_s\n");
+  printf("%lld,%lld,%.3f,%.3f,%.0f\n", (long long)st.calls,
+    (long long)st.differ, st.ns / 1e9, st.traceNs / 1e9,
+    st.calls / (st.ns / 1e9));
+  if (verbose) debDumpStats();
+  return st.differ != 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Build and run the throughput and latency benchmark suite, printing CSV.
+# Name workloads (seqwrite seqread randwrite randread create append meta
+# sweep) to run only those.  It formats its own BFSDISK in this directory,
+# leaving the one beside runit.sh alone
+
+cd "$(dirname "$0")"
+
+rm -f bench
+
+gcc -O2 -pthread -Wall -Wextra -Wno-sign-compare -o bench bench.c \
+  $(ls ../*.c | grep -v main.c)
+
+./bench "$@"
+
+rm -f BFSDISK
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Build the trace replayer, and replay trace file $1 (after any -p or -v
+# flags) against a copy of disk image $2.  With no $2, the trace must start
+# by formatting a fresh disk.  Either way the BFSDISK used is in this
+# directory, leaving the one beside runit.sh alone
+
+flags=()
+while [[ "$1" == -* ]]; do flags+=("$1"); shift; done
+trace="$(realpath "$1")"
+disk=""
+[ -n "$2" ] && disk="$(realpath "$2")"
+
+cd "$(dirname "$0")"
+
+rm -f replay BFSDISK BFSDISK.*
+[ -n "$disk" ] && cp "$disk" BFSDISK
+
+gcc -O2 -pthread -Wall -Wextra -Wno-sign-compare -o replay replay.c \
+  $(ls ../*.c | grep -v main.c)
+
+./replay "${flags[@]}" "$trace"
+
+rm -f BFSDISK BFSDISK.*
@@ -0,0 +1,15 @@
+#!/bin/bash
+
+# Build and run the multithreaded scaling benchmark.  It formats its own
+# BFSDISK in this directory, leaving the one beside runit.sh alone
+
+cd "$(dirname "$0")"
+
+rm -f scale
+
+gcc -O2 -pthread -Wall -Wextra -Wno-sign-compare -o scale scale.c \
+  $(ls ../*.c | grep -v main.c)
+
+./scale
+
+rm -f BFSDISK
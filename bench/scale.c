@@ -0,0 +1,107 @@
+// ============================================================================
+// scale.c - multithreaded scaling benchmark for BFS
+//
+// Each of 1, 2, 4 .. MAXTHREADS threads owns a file of its own.  In the
+// write phase every thread appends FILEBYTES to its file in CHUNK sized
+// fsWrite calls; in the read phase it reads the file back the same way.
+// Prints the aggregate throughput of each phase, per thread count, as CSV
+// ============================================================================
+
+#include <pthread.h>
+#include <time.h>
+
+#include "../bfs.h"
+#include "../fs.h"
+
+#define MAXTHREADS  8
+#define CHUNK       (64 * 1024)           // bytes per fsWrite/fsRead
+#define FILEBYTES   (16 * 1024 * 1024)    // bytes per thread's file
+#define READPASSES  4                     // times each file is read back
+
+typedef struct {          // one benchmark thread
+  pthread_t tid;
+  i32 fd;                 // the thread's own file
+  i32 write;              // 1 => write phase, 0 => read phase
+} Worker;
+
+// ============================================================================
+// Seconds since some fixed point, from the monotonic clock
+// ============================================================================
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// ============================================================================
+// Body of each thread: write or read its whole file, CHUNK at a time
+// ============================================================================
+static void* work(void* arg) {
+  Worker* w = (Worker*)arg;
+  i8* buf = malloc(CHUNK);
+  if (buf == NULL) FATAL(ENOMEM);
+  memset(buf, w->fd, CHUNK);
+
+  i32 passes = w->write ? 1 : READPASSES;
+  for (i32 p = 0; p < passes; ++p) {
+    fsSeek(w->fd, 0, SEEK_SET);
+    for (i32 off = 0; off < FILEBYTES; off += CHUNK) {
+      if (w->write) fsWrite(w->fd, CHUNK, buf);
+      else          fsRead (w->fd, CHUNK, buf);
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Run one phase on 'n' threads.  Return throughput in MB/s
+// ============================================================================
+static double phase(Worker* w, i32 n, i32 write) {
+  double t0 = now();
+  for (i32 i = 0; i < n; ++i) {
+    w[i].write = write;
+    pthread_create(&w[i].tid, NULL, work, &w[i]);
+  }
+  for (i32 i = 0; i < n; ++i) pthread_join(w[i].tid, NULL);
+  double secs = now() - t0;
+
+  double bytes = (double)n * FILEBYTES * (write ? 1 : READPASSES);
+  return bytes / secs / (1024 * 1024);
+}
+
+
+
+int main() {
+  printf("threads,write_mbs,read_mbs\n");
+
+  for (i32 n = 1; n <= MAXTHREADS; n *= 2) {
+
+    // A fresh disk for each run, with room for every thread's file
+
+    i32 blocks = (i32)(((i64)MAXTHREADS * FILEBYTES) / 4096) + 4096;
+    fsFormat(blocks, 4096, 64);
+    fsMount();
+
+    Worker w[MAXTHREADS];
+    for (i32 i = 0; i < n; ++i) {
+      char fname[FNAMESIZE];
+      sprintf(fname, "scale%d", i);
+      w[i].fd = fsCreate(fname);
+    }
+
+    double wr = phase(w, n, 1);
+    fsSync();
+    double rd = phase(w, n, 0);
+    printf("%d,%.1f,%.1f\n", n, wr, rd);
+    fflush(stdout);
+
+    for (i32 i = 0; i < n; ++i) fsClose(w[i].fd);
+    fsUnmount();
+  }
+  return 0;
+}
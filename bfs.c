@@ -2,99 +2,1236 @@
 // bfs.c
 // ============================================================================
 
+#include <pthread.h>
+
 #include "bfs.h"
+#include "prf.h"
+
+// Locking: each Inode has a reader/writer lock, taken by the fs* layer
+// around each call, that guards the Inode and the Extent blocks below it.
+// The OFT, the Directory, the allocator and the Extent block path cache
+// each have a mutex of their own, taken inside the bfs* functions that use
+// them; the File Descriptor Table shares the OFT's, and the queue of
+// blocks waiting to be freed shares the allocator's.  Locks are taken in
+// the order: Inode, Directory, allocator, OFT, then the journal and block
+// cache.  bfsSyncInode runs one thread at a time, under a mutex of its own.
+//
+// The fs* layer brackets each change with jnlBegin and jnlEnd, so the
+// changes commit whole: it takes the Inode lock first, and writes the
+// Inode back with bfsSyncInode before jnlEnd.  Within an operation,
+// nothing waits for an Inode lock another thread may hold
+
+FDTE  g_fdt[NUMFDTENTRIES];             // File Descriptor Table
+OFTE  g_oft[NUMOFTENTRIES];              // Open File Table
+Super g_super;                           // geometry of the mounted disk
+
+static pthread_mutex_t g_oftLock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_dirLock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_allocLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_leafLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_syncLock  = PTHREAD_MUTEX_INITIALIZER;
+
+static Inode* g_inodes = NULL;           // in-memory Inode table
+static u8*    g_inodeDirty = NULL;       // 1 => Inode changed since sync
+static pthread_rwlock_t* g_inodeLocks = NULL; // one per Inode
+
+typedef struct {          // in-memory Directory index entry
+  char fname[FNAMESIZE];  // file name.  "" => slot unused
+  i32  inum;              // inum of file
+  i32  dbn;               // Directory block holding the DirEnt
+  i32  slot;              // index of the DirEnt within that block
+} DirIndex;
+
+static DirIndex* g_dirIndex = NULL;      // name => inum, open addressing
+static i32       g_dirIndexSize = 0;     // power of 2, >= 2 * NUMINODES
+static u8*       g_inumUsed = NULL;      // 1 => inum named in Directory
+
+static u64* g_bitmap = NULL;             // in-memory free-block bitmap
+static i32  g_bmWords = 0;               // # of u64 words in 'g_bitmap'
+static i32  g_rotor   = 0;               // where the next search starts
+
+typedef struct {          // a run of blocks waiting to be freed
+  i32 dbn;                // first DBN of the run
+  i32 len;                // # of blocks in the run
+  i32 meta;               // 1 => held Extents or pointers, not file data
+} FreeRun;
+
+static FreeRun* g_freeRuns = NULL;       // queued by bfsTruncate, see bfsCommit
+static i32      g_numFree  = 0;          // # of runs in 'g_freeRuns'
+static i32      g_freeCap  = 0;          // room in 'g_freeRuns'
+static i32      g_freeSealed = 0;        // leading runs a commit has counted
+static i64      g_freeBase = 0;          // # of runs ever freed
+
+#define LEAFMAPS 64       // # of entries in g_leaf
+
+typedef struct {          // cached path to an Extent block
+  i32 root;               // DBN of the double- or triple-indirect block
+  i32 leaf;               // leaf number below 'root'
+  i32 dbn;                // DBN of that leaf Extent block
+} LeafMap;
+
+static LeafMap g_leaf[LEAFMAPS];         // root 0 => slot unused
+
+// ============================================================================
+// Find 'fname' in the in-memory Directory index.  Return its slot if it is
+// present, otherwise the unused slot where it would go
+// ============================================================================
+static DirIndex* dirIndexFind(str fname) {
+  u32 i = bfsDirHash(fname) & (g_dirIndexSize - 1);
+  while (g_dirIndex[i].fname[0] != 0) {
+    if (strcmp(g_dirIndex[i].fname, fname) == 0) break;
+    i = (i + 1) & (g_dirIndexSize - 1);
+  }
+  return &g_dirIndex[i];
+}
+
+
+
+// ============================================================================
+// Remove entry 'di' from the in-memory Directory index.  Later entries in
+// its probe run are shifted back, so lookups never stop early at the hole
+// ============================================================================
+static void dirIndexRemove(DirIndex* di) {
+  u32 mask = g_dirIndexSize - 1;
+  u32 hole = di - g_dirIndex;
+  u32 i    = hole;
+  for (;;) {
+    i = (i + 1) & mask;
+    if (g_dirIndex[i].fname[0] == 0) break;
+    u32 home = bfsDirHash(g_dirIndex[i].fname) & mask;
+    if (((i - home) & mask) < ((i - hole) & mask)) continue;  // must stay
+    g_dirIndex[hole] = g_dirIndex[i];
+    hole = i;
+  }
+  memset(&g_dirIndex[hole], 0, sizeof(DirIndex));
+}
+
+
+
+// ============================================================================
+// Set ('used' = 1) or clear ('used' = 0) the in-memory bitmap bits for the
+// 'n' blocks starting at 'dbn'.  Caller holds g_allocLock
+// ============================================================================
+static void bitmapSet(i32 dbn, i32 n, i32 used) {
+  if (g_bitmap == NULL)            FATAL(ENODISK);
+  if (dbn < 0)                     FATAL(EBADDBN);
+  if (dbn + n > BLOCKSPERDISK)     FATAL(EBADDBN);
+
+  for (i32 b = dbn; b < dbn + n; ++b) {
+    u64 bit = 1ULL << (b % 64);
+    if (used) g_bitmap[b / 64] |= bit; else g_bitmap[b / 64] &= ~bit;
+  }
+}
+
+
+
+// ============================================================================
+// Set ('used' = 1) or clear ('used' = 0) the bitmap bits for the 'n'
+// blocks starting at 'dbn', and write the bitmap through to its blocks.
+// Caller holds g_allocLock
+// ============================================================================
+static void bitmapMark(i32 dbn, i32 n, i32 used) {
+  bitmapSet(dbn, n, used);
+
+  // Write through just the bitmap blocks covering the changed bits
+
+  i32 bitsPerBlock = BYTESPERBLOCK * 8;
+  i32 first = dbn / bitsPerBlock;
+  i32 last  = (dbn + n - 1) / bitsPerBlock;
+  for (i32 b = first; b <= last; ++b) {
+    jnlWrite(DBNBITMAP + b, (i8*)g_bitmap + (i64)b * BYTESPERBLOCK);
+  }
+}
+
+
+
+// ============================================================================
+// Queue the 'n' blocks starting at 'dbn' to be freed by bfsCommit.  A run
+// that carries on from the last one queued joins it, unless a commit has
+// already counted that one
+// ============================================================================
+static void freeQueue(i32 dbn, i32 n, i32 meta) {
+  pthread_mutex_lock(&g_allocLock);
+  FreeRun* last = NULL;
+  if (g_numFree > g_freeSealed) last = &g_freeRuns[g_numFree - 1];
+  if (last && last->meta == meta && last->dbn + last->len == dbn) {
+    last->len += n;
+  } else {
+    if (g_numFree == g_freeCap) {
+      g_freeCap  = g_freeCap ? 2 * g_freeCap : 64;
+      g_freeRuns = realloc(g_freeRuns, g_freeCap * sizeof(FreeRun));
+      if (g_freeRuns == NULL) FATAL(ENOMEM);
+    }
+    g_freeRuns[g_numFree++] = (FreeRun){dbn, n, meta};
+  }
+  pthread_mutex_unlock(&g_allocLock);
+}
+
+
+
+// ============================================================================
+// Order FreeRuns by DBN, for qsort
+// ============================================================================
+static int freeCompare(const void* a, const void* b) {
+  i32 x = ((FreeRun*)a)->dbn;
+  i32 y = ((FreeRun*)b)->dbn;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Hand the queued FreeRuns before number 'upto' (counting every run ever
+// queued) back to the allocator, unless another commit already has.  Their
+// bits are cleared together and each bitmap block touched is written once.
+// If any run held metadata, the log is checkpointed first: a committed
+// copy of it must never be replayed over the block's next owner.  Return
+// the number of runs freed.  Caller holds jnlPause: should the bitmap blocks
+// overflow the running transaction, the part committed early only leaks
+// blocks, never hands out ones still mapped
+// ============================================================================
+static i32 freeApply(i64 upto) {
+  pthread_mutex_lock(&g_allocLock);
+  i32 n = (i32)(upto - g_freeBase);
+  if (n <= 0) {
+    pthread_mutex_unlock(&g_allocLock);
+    return 0;
+  }
+
+  i32 meta = 0;
+  for (i32 i = 0; i < n; ++i) meta |= g_freeRuns[i].meta;
+  if (meta) jnlCheckpoint();
+
+  qsort(g_freeRuns, n, sizeof(FreeRun), freeCompare);
+  for (i32 i = 0; i < n; ++i) {
+    FreeRun* fr = &g_freeRuns[i];
+    bitmapSet(fr->dbn, fr->len, 0);
+    for (i32 b = 0; fr->meta && b < fr->len; ++b) jnlForget(fr->dbn + b);
+    bioDiscard(fr->dbn, fr->len);
+  }
+
+  i32 bitsPerBlock = BYTESPERBLOCK * 8;
+  i32 written = -1;                       // last bitmap block written
+  for (i32 i = 0; i < n; ++i) {
+    FreeRun* fr = &g_freeRuns[i];
+    i32 first = fr->dbn / bitsPerBlock;
+    i32 last  = (fr->dbn + fr->len - 1) / bitsPerBlock;
+    if (first <= written) first = written + 1;
+    for (i32 b = first; b <= last; ++b) {
+      jnlWrite(DBNBITMAP + b, (i8*)g_bitmap + (i64)b * BYTESPERBLOCK);
+    }
+    if (last > written) written = last;
+  }
+
+  g_numFree    -= n;
+  g_freeSealed -= n;
+  g_freeBase   += n;
+  memmove(g_freeRuns, g_freeRuns + n, g_numFree * sizeof(FreeRun));
+  pthread_mutex_unlock(&g_allocLock);
+  return n;
+}
+
+
+
+// ============================================================================
+// Keep the first 'keep' Extent blocks below pointer block '*dbn', which
+// sits 'depth' levels above them (1 => its entries are Extent blocks),
+// and queue the rest to be freed.  With 'keep' 0, '*dbn' goes too, and is
+// zeroed; otherwise it is rewritten if any entry was dropped
+// ============================================================================
+static void ptrTrim(i32* dbn, i64 keep, i32 depth) {
+  if (*dbn == 0) return;
+
+  i64 span = (depth == 1) ? 1 : PTRSPERBLOCK;   // Extent blocks per entry
+  i8 buf[BYTESPERBLOCK];
+  bioRead(*dbn, buf);
+  i32* ptr = (i32*)buf;
+
+  i32 changed = 0;
+  for (i32 i = 0; i < PTRSPERBLOCK; ++i) {
+    i64 k = keep - i * span;              // Extent blocks to keep below 'i'
+    if (k < 0) k = 0;
+    if (ptr[i] == 0 || k >= span) continue;
+    i32 child = ptr[i];
+    if (depth == 1) {
+      freeQueue(child, 1, 1);
+      child = 0;
+    } else {
+      ptrTrim(&child, k, depth - 1);
+    }
+    if (child != ptr[i]) { ptr[i] = child; changed = 1; }
+  }
+
+  if (keep == 0) {
+    freeQueue(*dbn, 1, 1);
+    *dbn = 0;
+  } else if (changed) {
+    jnlWrite(*dbn, buf);
+  }
+}
+
+
+
+// ============================================================================
+// Queue the Extent blocks, and the pointer blocks above them, that 'inode'
+// no longer needs now that its Extents are cut back to 'numExtents'
+// ============================================================================
+static void extTrim(Inode* inode) {
+  i64 leaves = 0;                         // # of Extent blocks still needed
+  if (inode->numExtents > NUMEXTENTS) {
+    leaves = ((i64)inode->numExtents - NUMEXTENTS + EXTPERBLOCK - 1)
+           / EXTPERBLOCK;
+  }
+
+  if (leaves == 0 && inode->indirect != 0) {
+    freeQueue(inode->indirect, 1, 1);
+    inode->indirect = 0;
+  }
+
+  i64 below = leaves - 1;                 // leaves below 'dindirect'
+  if (below < 0)            below = 0;
+  if (below > PTRSPERBLOCK) below = PTRSPERBLOCK;
+  ptrTrim(&inode->dindirect, below, 1);
+
+  below = leaves - 1 - PTRSPERBLOCK;      // leaves below 'tindirect'
+  if (below < 0) below = 0;
+  ptrTrim(&inode->tindirect, below, 2);
+}
+
+
+
+// ============================================================================
+// Follow entry 'i' of the pointer block at '*dbn' down one level.  When
+// 'alloc', fill a missing entry with a fresh zeroed block; otherwise a
+// missing entry is fatal
+// ============================================================================
+static i32 extDown(i32* dbn, i32 i, i32 alloc) {
+  if (*dbn == 0 && !alloc) FATAL(ENODBN);
+  if (*dbn == 0) *dbn = bfsFindFreeBlock();
+
+  i8 buf[BYTESPERBLOCK];
+  bioRead(*dbn, buf);
+  i32* ptr = (i32*)buf;
+  if (ptr[i] == 0 && !alloc) FATAL(ENODBN);
+  if (ptr[i] == 0) {
+    ptr[i] = bfsFindFreeBlock();
+    jnlWrite(*dbn, buf);
+  }
+  return ptr[i];
+}
+
+
+
+// ============================================================================
+// Find the Extent block holding Extent number 'idx' (>= NUMEXTENTS) of
+// 'inode', and the slot within it.  Extents past the indirect block hang
+// below the double-indirect block, then the triple-indirect block, one
+// Extent block per leaf pointer.  Deep lookups are served from g_leaf, so
+// they cost no pointer-block reads once warm.  When 'alloc', missing
+// blocks along the path are allocated; the caller writes the Inode back
+// ============================================================================
+static i32 extLeaf(Inode* inode, i32 idx, i32 alloc, i32* slot) {
+  i64 n = idx - NUMEXTENTS;
+  *slot = n % EXTPERBLOCK;
+  n /= EXTPERBLOCK;                     // leaf number
+
+  if (n == 0) {
+    if (inode->indirect == 0 && !alloc) FATAL(ENODBN);
+    if (inode->indirect == 0) inode->indirect = bfsFindFreeBlock();
+    return inode->indirect;
+  }
+
+  n -= 1;
+  i32* root = &inode->dindirect;
+  if (n >= PTRSPERBLOCK) {
+    n -= PTRSPERBLOCK;
+    root = &inode->tindirect;
+  }
+
+  if (*root != 0) {
+    pthread_mutex_lock(&g_leafLock);
+    LeafMap lm = g_leaf[(u32)(*root * 31 + n) % LEAFMAPS];
+    pthread_mutex_unlock(&g_leafLock);
+    if (lm.root == *root && lm.leaf == n) return lm.dbn;
+  }
+
+  i32 dbn = 0;
+  if (root == &inode->dindirect) {
+    dbn = extDown(root, n, alloc);
+  } else {
+    i32 mid = extDown(root, n / PTRSPERBLOCK, alloc);
+    dbn = extDown(&mid, n % PTRSPERBLOCK, alloc);
+  }
+
+  pthread_mutex_lock(&g_leafLock);
+  LeafMap* lm = &g_leaf[(u32)(*root * 31 + n) % LEAFMAPS];
+  lm->root = *root;
+  lm->leaf = n;
+  lm->dbn  = dbn;
+  pthread_mutex_unlock(&g_leafLock);
+  return dbn;
+}
+
+
+
+// ============================================================================
+// Most blocks one more run taken by bfsAllocBlocks may add to the journal,
+// when mapped by a new Extent number 'idx' of 'inode': bitmap blocks for
+// the run and for any new Extent or pointer block, the pointer blocks that
+// point at a new Extent block, and each Extent block the insert shifts
+// ============================================================================
+static i32 allocCost(Inode* inode, i32 idx) {
+  i32 last   = inode->numExtents;         // the new last Extent
+  i32 leaves = 0;                         // Extent blocks rewritten
+  i32 ptrs   = 0;                         // pointer blocks rewritten
+  if (last >= NUMEXTENTS) {
+    i32 from = (idx > NUMEXTENTS) ? idx : NUMEXTENTS;
+    leaves = (last - NUMEXTENTS) / EXTPERBLOCK
+           - (from - NUMEXTENTS) / EXTPERBLOCK + 1;
+    if ((last - NUMEXTENTS) % EXTPERBLOCK == 0) ptrs = 2;
+  }
+
+  i32 bitmap = 2 + (ptrs ? 3 : 0);        // run may straddle two blocks
+  if (bitmap > g_super.numBitmapBlocks) bitmap = g_super.numBitmapBlocks;
+  return bitmap + ptrs + leaves;
+}
+
+
+
+// ============================================================================
+// Allocate a free disk block for the file whose Inode number is 'inum' and
+// map it as FBN 'fbn' in the file's Extents.  On success, return the DBN
+// allocated.  On failure, abort
+// ============================================================================
+i32 bfsAllocBlock(i32 inum, i32 fbn) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+
+  Inode* inode = bfsGetInode(inum);
+
+  // Grab a free block in the BFS disk, as close as possible after the
+  // block holding the previous FBN, so the file stays contiguous
+
+  i32 idx  = bfsExtFind(inode, fbn);      // Extent at or before 'fbn'
+  Extent prev = {0, 0, 0};
+  if (idx >= 0) bfsExtGet(inode, idx, &prev);
+  if (idx >= 0 && fbn < prev.fbn + prev.len) return prev.dbn + fbn - prev.fbn;
+
+  i32 goal = -1;                          // carry on from the rotor
+  if (idx >= 0) goal = prev.dbn + fbn - prev.fbn;
+
+  i32 got = 0;
+  i32 dbn = bfsAllocRun(goal, 1, &got);
+
+  // Map the block: grow the Extent before it, or the one after it, when
+  // the new block is adjacent on disk; otherwise insert a new Extent
+
+  Extent next = {0, 0, 0};
+  i32 hasNext = (idx + 1 < inode->numExtents);
+  if (hasNext) bfsExtGet(inode, idx + 1, &next);
+
+  i32 joinPrev = idx >= 0 && prev.fbn + prev.len == fbn
+                          && prev.dbn + prev.len == dbn;
+  i32 joinNext = hasNext && next.fbn == fbn + 1 && next.dbn == dbn + 1;
+
+  if (joinPrev && joinNext) {
+    prev.len += 1 + next.len;
+    bfsExtPut(inode, idx, &prev);
+    bfsExtDelete(inode, idx + 1);
+  } else if (joinPrev) {
+    ++prev.len;
+    bfsExtPut(inode, idx, &prev);
+  } else if (joinNext) {
+    next.fbn = fbn;
+    next.dbn = dbn;
+    ++next.len;
+    bfsExtPut(inode, idx + 1, &next);
+  } else {
+    Extent ext = {fbn, dbn, 1};
+    bfsExtInsert(inode, idx + 1, &ext);
+  }
+
+  bfsDirtyInode(inum);
+  bfsInvalMaps(inum);                     // Extents changed
+  return dbn;                             // allocated DBN
+}
+
+
+
+// ============================================================================
+// Allocate 'n' blocks for the file whose Inode number is 'inum' and map them
+// as FBNs 'fbn' .. 'fbn' + n - 1, which must be unmapped.  Blocks are taken
+// in as few runs as the bitmap allows, each mapped by one Extent (or by
+// growing the Extent before it), and the Inode is dirtied once for the
+// lot.  Each run is first reserved in the caller's journal operation; when
+// the operation has no room left, the FBNs after the last run are left
+// unmapped.  Return the number of blocks allocated.  On failure, abort
+// ============================================================================
+i32 bfsAllocBlocks(i32 inum, i32 fbn, i32 n) {
+
+  if (inum < 0)             FATAL(EBADINUM);
+  if (inum > MAXINUM)       FATAL(EBADINUM);
+  if (fbn  < 0)             FATAL(EBADFBN);
+  if (n <= 0)               FATAL(ENEGNUMB);
+  if (fbn + n - 1 > MAXFBN) FATAL(EBADFBN);
+
+  i64 t0 = prfBegin(PRFBFSALLOC);
+
+  Inode* inode = bfsGetInode(inum);
+
+  // The FBNs must fall in a hole: after Extent 'idx', before the next
+
+  i32 idx = bfsExtFind(inode, fbn);       // Extent at or before 'fbn'
+  Extent prev = {0, 0, 0};
+  if (idx >= 0) bfsExtGet(inode, idx, &prev);
+  if (idx >= 0 && fbn < prev.fbn + prev.len) FATAL(EBADFBN);
+
+  if (idx + 1 < inode->numExtents) {
+    Extent next;
+    bfsExtGet(inode, idx + 1, &next);
+    if (fbn + n > next.fbn) FATAL(EBADFBN);
+  }
+
+  // Place the blocks right after the block holding the previous FBN where
+  // possible, so the file stays contiguous
+
+  i32 goal = -1;                          // carry on from the rotor
+  if (idx >= 0) goal = prev.dbn + fbn - prev.fbn;
+
+  i32 f = 0;
+  while (f < n) {
+    if (!jnlReserve(allocCost(inode, idx + 1))) break;
+
+    i32 want = n - f;                     // at most one bitmap block's worth
+    if (want > BYTESPERBLOCK * 8) want = BYTESPERBLOCK * 8;
+    i32 got = 0;
+    i32 dbn = bfsAllocRun(goal, want, &got);
+
+    if (idx >= 0 && prev.fbn + prev.len == fbn + f
+                 && prev.dbn + prev.len == dbn) {
+      prev.len += got;
+      bfsExtPut(inode, idx, &prev);
+    } else {
+      prev.fbn = fbn + f;
+      prev.dbn = dbn;
+      prev.len = got;
+      bfsExtInsert(inode, ++idx, &prev);
+    }
+
+    f += got;
+    goal = dbn + got;
+  }
+
+  bfsDirtyInode(inum);
+  bfsInvalMaps(inum);                     // Extents changed
+  prfEnd(PRFBFSALLOC, t0, (i64)f * BYTESPERBLOCK, f);
+  return f;
+}
+
+
+
+// ============================================================================
+// Allocate whichever of FBNs 'fbn' .. 'fbn' + 'n' - 1 of file 'inum' are not
+// yet mapped, one bfsAllocBlocks per hole.  Holes elsewhere in the file are
+// left alone.  Return the number of FBNs from 'fbn' on now mapped: less
+// than 'n' when the caller's journal operation ran out of room.  On
+// failure, abort
+// ============================================================================
+i32 bfsAllocRange(i32 inum, i32 fbn, i32 n) {
+  i32 f = 0;
+  while (f < n) {
+    i32 dbn = 0;
+    i32 run = bfsMapRange(inum, fbn + f, n - f, &dbn);
+    if (dbn == ENODBN) {
+      i32 got = bfsAllocBlocks(inum, fbn + f, run);
+      if (got < run) return f + got;
+    }
+    f += run;
+  }
+  return f;
+}
+
+
+
+// ============================================================================
+// Allocate a run of up to 'want' adjacent free blocks, starting as near as
+// possible at or after DBN 'goal' (wrapping round the disk); a negative
+// 'goal' carries on from where the last allocation ended.  A run of the
+// full length is preferred; failing that, the longest run found is taken.
+// Set '*got' to the length of the run and return its first DBN.  FATAL if
+// the disk is full
+// ============================================================================
+i32 bfsAllocRun(i32 goal, i32 want, i32* got) {
+
+  if (want <= 0)     FATAL(ENEGNUMB);
+  if (got == NULL)   FATAL(ENULLPTR);
+  if (g_bitmap == NULL) FATAL(ENODISK);
+
+  pthread_mutex_lock(&g_allocLock);
+
+  if (goal < 0) goal = g_rotor;
+  if (goal < MINDBN || goal >= BLOCKSPERDISK) goal = MINDBN;
+
+  i32 best = -1;                          // longest short run seen
+  i32 bestLen = 0;
+
+  // Search [goal, end of disk), then wrap round to [MINDBN, goal)
+
+  for (i32 pass = 0; pass < 2; ++pass) {
+    i32 pos = (pass == 0) ? goal : MINDBN;
+    i32 end = (pass == 0) ? BLOCKSPERDISK : goal;
+
+    while (pos < end) {
+      i32 start = bfsBitmapScan(pos, 0);  // next free block
+      if (start >= end) break;
+      i32 stop = bfsBitmapScan(start, 1); // next used block
+      if (stop > end) stop = end;
+
+      i32 len = stop - start;
+      if (len >= want) { best = start; bestLen = want; break; }
+      if (len > bestLen) { best = start; bestLen = len; }
+      pos = stop;
+    }
+    if (bestLen == want) break;
+  }
+
+  if (best < 0) FATAL(EDISKFULL);
+
+  bitmapMark(best, bestLen, 1);
+  g_rotor = best + bestLen;
+  pthread_mutex_unlock(&g_allocLock);
+
+  *got = bestLen;
+  return best;
+}
+
+
+
+// ============================================================================
+// Set ('used' = 1) or clear ('used' = 0) the bitmap bits for the 'n'
+// blocks starting at 'dbn', and write the bitmap through to its blocks
+// ============================================================================
+i32 bfsBitmapMark(i32 dbn, i32 n, i32 used) {
+  pthread_mutex_lock(&g_allocLock);
+  bitmapMark(dbn, n, used);
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the first DBN at or after 'from' whose bitmap bit is 'used' (1 for
+// an allocated block, 0 for a free one), or BLOCKSPERDISK if there is none.
+// Whole 64-block words are skipped at a time
+// ============================================================================
+i32 bfsBitmapScan(i32 from, i32 used) {
+  if (from >= BLOCKSPERDISK) return BLOCKSPERDISK;
+
+  i32 w    = from / 64;
+  u64 word = used ? g_bitmap[w] : ~g_bitmap[w];
+  word &= ~0ULL << (from % 64);           // ignore bits before 'from'
+
+  while (word == 0) {
+    if (++w >= g_bmWords) return BLOCKSPERDISK;
+    word = used ? g_bitmap[w] : ~g_bitmap[w];
+  }
+
+  i32 dbn = w * 64 + __builtin_ctzll(word);
+  return (dbn < BLOCKSPERDISK) ? dbn : BLOCKSPERDISK;
+}
+
+
+
+// ============================================================================
+// Release File Descriptor 'fd'.  Return the inum of the file it had open.
+// The caller drops the file's reference in the OFT
+// ============================================================================
+i32 bfsCloseFd(i32 fd) {
+  i32 inum = bfsFdToInum(fd);            // abort if 'fd' is not open
+
+  pthread_mutex_lock(&g_oftLock);
+  memset(&g_fdt[fd - FIRSTFD], 0, sizeof(FDTE));
+  g_fdt[fd - FIRSTFD].inum = -1;
+  pthread_mutex_unlock(&g_oftLock);
+  return inum;
+}
+
+
+
+// ============================================================================
+// Commit the metadata changed so far as one journal transaction, once the
+// operations in progress have ended.  The blocks their truncates queued
+// are handed back to the allocator first, in the same transaction: the
+// Inodes that no longer map them commit with the bitmap that frees them.
+// The caller must not hold an Inode lock
+// ============================================================================
+i32 bfsCommit() {
+  i64 t0 = prfBegin(PRFBFSCOMMIT);
+  jnlPause();
+  pthread_mutex_lock(&g_allocLock);
+  i64 upto = g_freeBase + g_numFree;      // queued by ended operations
+  g_freeSealed = g_numFree;
+  pthread_mutex_unlock(&g_allocLock);
+
+  freeApply(upto);
+  jnlCommit();
+  jnlResume();
+  prfEnd(PRFBFSCOMMIT, t0, 0, 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Create file 'fname'.  Find a free inum, and a free DirEnt in the hashed
+// Directory.  If 'fname' already exists, reuse its inum, leaving its
+// contents for the caller to truncate.  Leave the size of a new file as
+// zero, until the user performs a write, or a seek into the file.  On
+// success, return the file's inum.  On failure, abort
+// ============================================================================
+i32 bfsCreateFile(str fname) {
+
+  if (fname == NULL) FATAL(ENULLPTR);
+
+  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
+
+  pthread_mutex_lock(&g_dirLock);
+
+  DirIndex* di = dirIndexFind(fname);
+  if (di->fname[0] != 0) {                              // already exists
+    i32 inum = di->inum;
+    bfsRefOFT(inum);
+    pthread_mutex_unlock(&g_dirLock);
+    return inum;
+  }
+
+  i32 inum = 0;                                         // free inum
+  while (inum < NUMINODES && g_inumUsed[inum]) ++inum;
+  if (inum == NUMINODES) FATAL(EDIRFULL);
+
+  // Probe the Directory blocks, starting at the name's home bucket, for a
+  // free DirEnt
+
+  i8 buf[BYTESPERBLOCK];
+  DirEnt* ents = (DirEnt*)buf;
+  i32 home = bfsDirHash(fname) % NUMDIRBLOCKS;
+
+  for (i32 probe = 0; probe < NUMDIRBLOCKS; ++probe) {
+    i32 dbn = DBNDIR + (home + probe) % NUMDIRBLOCKS;
+    bioRead(dbn, ents);
+    for (i32 slot = 0; slot < DIRPERBLOCK; ++slot) {
+      if (ents[slot].fname[0] != 0) continue;           // in use
+      memset(&ents[slot], 0, sizeof(DirEnt));
+      strcpy(ents[slot].fname, fname);
+      ents[slot].inum = inum;
+      jnlWrite(dbn, ents);
+
+      strcpy(di->fname, fname);
+      di->inum = inum;
+      di->dbn  = dbn;
+      di->slot = slot;
+      g_inumUsed[inum] = 1;
+
+      bfsRefOFT(inum);
+      pthread_mutex_unlock(&g_dirLock);
+      return inum;
+    }
+  }
+
+  FATAL(EDIRFULL);                                      // Directory full
+  return 0;                                             // pacify compiler
+}
+
+
+
+// ============================================================================
+// Delete file 'fname': remove its DirEnt, truncate it to nothing (which
+// queues all its blocks to be freed, see bfsTruncate) and release its
+// inum.  On success, return 0.  If 'fname' does not exist, return EFNF.  If
+// it is open, leave it be and return EFILEOPEN
+// ============================================================================
+i32 bfsDeleteFile(str fname) {
+
+  if (fname == NULL) FATAL(ENULLPTR);
+
+  pthread_mutex_lock(&g_dirLock);
+
+  DirIndex* di = dirIndexFind(fname);
+  if (di->fname[0] == 0) {                              // no such file
+    pthread_mutex_unlock(&g_dirLock);
+    return EFNF;
+  }
+
+  i32 inum = di->inum;
+  pthread_mutex_lock(&g_oftLock);
+  i32 open = bfsOpenOFTE(inum) >= 0;
+  pthread_mutex_unlock(&g_oftLock);
+  if (open) {                                           // still in use
+    pthread_mutex_unlock(&g_dirLock);
+    return EFILEOPEN;
+  }
+
+  i8 buf[BYTESPERBLOCK];
+  DirEnt* ents = (DirEnt*)buf;
+  bioRead(di->dbn, ents);
+  memset(&ents[di->slot], 0, sizeof(DirEnt));
+  jnlWrite(di->dbn, ents);
+  dirIndexRemove(di);
+
+  pthread_mutex_unlock(&g_dirLock);
+
+  // Nobody can reach the file now.  Its inum stays taken until its blocks
+  // are queued and its Inode is empty
+
+  bfsLockInode(inum, 1);
+  bfsTruncate(inum, 0);
+  memset(bfsGetInode(inum), 0, sizeof(Inode));
+  bfsDirtyInode(inum);
+  bfsSyncInode(inum);
+  bfsUnlockInode(inum);
+
+  pthread_mutex_lock(&g_dirLock);
+  g_inumUsed[inum] = 0;
+  pthread_mutex_unlock(&g_dirLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Dereference file with Inode number 'inum' in the Open File Table.  If
+// refcount reaches 0, free up that entry in the OFT
+// ============================================================================
+i32 bfsDerefOFT(i32 inum) {
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsFindOFTE(inum);
+  if (g_oft[ofte].refs > 0) --g_oft[ofte].refs;
+  if (g_oft[ofte].refs == 0) {
+    g_oft[ofte].inum = 0;
+    memset(g_oft[ofte].map, 0, sizeof(g_oft[ofte].map));
+  }
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Hash of file name 'fname' (FNV-1a).  Picks both the home Directory block
+// and the slot in the in-memory Directory index
+// ============================================================================
+u32 bfsDirHash(str fname) {
+  u32 h = 2166136261u;
+  for (u8* p = (u8*)fname; *p != 0; ++p) {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+
+// ============================================================================
+// Mark Inode 'inum', changed in place in the Inode table, as needing to be
+// written back by bfsSyncInode
+// ============================================================================
+i32 bfsDirtyInode(i32 inum) {
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  g_inodeDirty[inum] = 1;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Remove Extent number 'idx' from 'inode', shifting later Extents down.  The
+// caller writes the Inode back
+// ============================================================================
+i32 bfsExtDelete(Inode* inode, i32 idx) {
+  if (idx < 0 || idx >= inode->numExtents) FATAL(EBADFBN);
+
+  Extent ext;
+  for (i32 i = idx + 1; i < inode->numExtents; ++i) {
+    bfsExtGet(inode, i, &ext);
+    bfsExtPut(inode, i - 1, &ext);
+  }
+  --inode->numExtents;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Binary search the Extents of 'inode', which are sorted by FBN, for the
+// last one starting at or before 'fbn'.  Return its index, or -1 if 'fbn'
+// lies before the first Extent
+// ============================================================================
+i32 bfsExtFind(Inode* inode, i32 fbn) {
+  i32 lo = 0;
+  i32 hi = inode->numExtents - 1;
+  i32 found = -1;
+  Extent ext;
+
+  while (lo <= hi) {
+    i32 mid = lo + (hi - lo) / 2;
+    bfsExtGet(inode, mid, &ext);
+    if (ext.fbn <= fbn) { found = mid; lo = mid + 1; }
+    else                { hi = mid - 1; }
+  }
+  return found;
+}
+
+
+
+// ============================================================================
+// Fetch Extent number 'idx' of 'inode' into 'ext'.  The first NUMEXTENTS
+// live in the Inode; the rest in Extent blocks reached via extLeaf
+// ============================================================================
+i32 bfsExtGet(Inode* inode, i32 idx, Extent* ext) {
+  if (idx < 0 || idx >= MAXEXTENTS) FATAL(EBADFBN);
+
+  if (idx < NUMEXTENTS) {
+    *ext = inode->extent[idx];
+    return 0;
+  }
+
+  i32 slot = 0;
+  i32 leaf = extLeaf(inode, idx, 0, &slot);
+  i8 buf[BYTESPERBLOCK];
+  bioRead(leaf, buf);
+  *ext = ((Extent*)buf)[slot];
+  return 0;
+}
+
+
+
+// ============================================================================
+// Insert 'ext' as Extent number 'idx' of 'inode', shifting later Extents
+// up.  Allocates any Extent or pointer block the new last Extent needs.
+// The caller writes the Inode back
+// ============================================================================
+i32 bfsExtInsert(Inode* inode, i32 idx, Extent* ext) {
+  if (idx < 0 || idx > inode->numExtents)  FATAL(EBADFBN);
+  if (inode->numExtents >= MAXEXTENTS)     FATAL(ENOEXTENT);
+
+  if (inode->numExtents >= NUMEXTENTS) {
+    i32 slot = 0;
+    extLeaf(inode, inode->numExtents, 1, &slot);
+  }
+
+  Extent tmp;
+  for (i32 i = inode->numExtents; i > idx; --i) {
+    bfsExtGet(inode, i - 1, &tmp);
+    bfsExtPut(inode, i, &tmp);
+  }
+  ++inode->numExtents;
+  bfsExtPut(inode, idx, ext);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Store 'ext' as Extent number 'idx' of 'inode'.  The caller writes the
+// Inode back
+// ============================================================================
+i32 bfsExtPut(Inode* inode, i32 idx, Extent* ext) {
+  if (idx < 0 || idx >= MAXEXTENTS) FATAL(EBADFBN);
+
+  if (idx < NUMEXTENTS) {
+    inode->extent[idx] = *ext;
+    return 0;
+  }
+
+  i32 slot = 0;
+  i32 leaf = extLeaf(inode, idx, 0, &slot);
+  i8 buf[BYTESPERBLOCK];
+  bioRead(leaf, buf);
+  ((Extent*)buf)[slot] = *ext;
+  jnlWrite(leaf, buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
+// if not yet mapped
+// ============================================================================
+i32 bfsFbnToDbn(i32 inum, i32 fbn) {
+  i32 dbn = 0;
+  bfsMapRange(inum, fbn, 1, &dbn);
+  return dbn;
+}
+
+
+
+// ============================================================================
+// Convert FileDescriptor (user-visible) to Inum (internal).  Abort if 'fd'
+// is not open
+// ============================================================================
+i32 bfsFdToInum(i32 fd) { 
+  i32 slot = fd - FIRSTFD;
+  if (slot < 0 || slot >= NUMFDTENTRIES) FATAL(EBADFDESC);
+
+  pthread_mutex_lock(&g_oftLock);
+  i32 inum = g_fdt[slot].inum;
+  pthread_mutex_unlock(&g_oftLock);
+
+  if (inum < 0) FATAL(EBADFDESC);
+  return inum;
+}
+
+
+
+
+// ============================================================================
+// Find 'inum' in the Open File Table (OFT).  If not found, create an entry,
+// with no references yet.  Return the index within the OFT.  On failure,
+// EOFTFULL.  Caller holds g_oftLock
+// ============================================================================
+i32 bfsFindOFTE(i32 inum) {
+  for (int i = 0; i < NUMOFTENTRIES; ++i) {     // unused slots hold inum 0
+    if (g_oft[i].inum == inum && g_oft[i].refs > 0) return i;
+  }
+  
+  // Not found, so look for an OFTE that nobody references
+
+  for (int i = 0; i < NUMOFTENTRIES; ++i) {
+    if (g_oft[i].refs == 0) {
+      g_oft[i].inum = inum;
+      g_oft[i].refs = 0;
+      memset(g_oft[i].map, 0, sizeof(g_oft[i].map));
+      g_oft[i].mapNext = 0;
+      return i;
+    }
+  }
+  FATAL(EOFTFULL);      // no-return
+  return 0;             // pacify compiler
+}
+
+
+
+// ============================================================================
+// Allocate one free block, zero-filled, from the bitmap.  On success,
+// return DBN.  FATAL otherwise
+// ============================================================================
+i32 bfsFindFreeBlock() {
+  i32 got = 0;
+  i32 dbn = bfsAllocRun(-1, 1, &got);
+
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  jnlWrite(dbn, buf);
+  return dbn;
+}
+
+
+
+// ============================================================================
+// Write back the dirty cached data blocks of file 'inum', in DBN order.
+// Caller holds the file's Inode lock
+// ============================================================================
+i32 bfsFlushFile(i32 inum) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+
+  Inode* inode = bfsGetInode(inum);
+  Extent ext;
+  for (i32 idx = 0; idx < inode->numExtents; ++idx) {
+    bfsExtGet(inode, idx, &ext);
+    bioFlushRange(ext.dbn, ext.len);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the initial free-block bitmap blocks.  The metadata blocks are
+// marked used; every other block is free
+// ============================================================================
+i32 bfsInitBitmap() {
+  i32 bitsPerBlock = BYTESPERBLOCK * 8;
+  u8  buf[BYTESPERBLOCK];
+
+  for (i32 b = 0; b < g_super.numBitmapBlocks; ++b) {
+    memset(buf, 0, BYTESPERBLOCK);
+    for (i32 bit = 0; bit < bitsPerBlock; ++bit) {
+      i64 dbn = (i64)b * bitsPerBlock + bit;
+      if (dbn >= NUMMETA) break;
+      buf[bit / 8] |= 1 << (bit % 8);
+    }
+    bioWrite(DBNBITMAP + b, buf);
+  }
+  return 0;
+}
+
+
 
 // ============================================================================
-// Allocate a free disk block for the file whose Inode number is 'inum' and
-// assign it to FBN 'fbn' in the file's Inode.  On success, return the DBN
-// allocated.  On failure, abort
+// Write the initial Dir blocks, of all zeroes
 // ============================================================================
-i32 bfsAllocBlock(i32 inum, i32 fbn) {
+i32 bfsInitDir() {
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  for (i32 b = 0; b < NUMDIRBLOCKS; ++b) bioWrite(DBNDIR + b, buf);
+  return 0;
+}
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
 
-  // Grab the next free block in the BFS disk
 
-  i32 dbn = bfsFindFreeBlock();
+// ============================================================================
+// Write the initial Inodes blocks, of all zeroes
+// ============================================================================
+i32 bfsInitInodes() {
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  for (i32 b = 0; b < g_super.numInodeBlocks; ++b) bioWrite(DBNINODES + b, buf);
+  return 0;
+}
 
-  // Update the corresponding Inode, or IndirectBlock
 
-  i8 buf8[BYTESPERBLOCK] = {0};           // 1-block buffer
-  bioRead(DBNINODES, buf8);
- 
-  Inode* pinodes = (Inode*)buf8;          // array of Inodes
-  Inode* pinode  = &pinodes[inum];        // target Inode
 
-  if (fbn < NUMDIRECT) {                  // in direct[] array?
-    pinode->direct[fbn] = dbn;
-    bioWrite(DBNINODES, buf8);
-    return dbn;
-  } else {                                // in indirect block?
-    i16 buf16[I16SPERBLOCK]= {0};
-    i32 dbnIndirect = pinode->indirect;   // DBN of indirect block
+// ============================================================================
+// Initialize the Open File Table to all zeroes, and empty the File
+// Descriptor Table
+// ============================================================================
+i32 bfsInitOFT() {
+  pthread_mutex_lock(&g_oftLock);
+  memset(g_fdt, 0, sizeof(g_fdt));
+  for (i32 i = 0; i < NUMFDTENTRIES; ++i) g_fdt[i].inum = -1;
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    g_oft[i].inum = 0;
+    g_oft[i].refs = 0;
+    memset(g_oft[i].map, 0, sizeof(g_oft[i].map));
+    g_oft[i].mapNext = 0;
+  }
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
 
-    if (dbnIndirect == 0) {               // not yet allocated
-      dbnIndirect = bfsFindFreeBlock();
-      pinode->indirect = dbn;
-    }
 
-    bioRead(dbnIndirect, buf16);
+// ============================================================================
+// Write the Super block, laid out by bfsMakeSuper, into DBN 0
+// ============================================================================
+i32 bfsInitSuper() {
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  memcpy(buf, &g_super, sizeof(Super));
 
-    buf16[fbn - NUMDIRECT] = dbn;
-    bioWrite(dbnIndirect, buf16);
-  }
+  return bioWrite(DBNSUPER, buf);
+}
 
-  return dbn;                             // allocated DBN
 
+
+// ============================================================================
+// Forget the Extents cached in every OFTE of file 'inum'.  Called whenever
+// the file's block mapping changes
+// ============================================================================
+i32 bfsInvalMaps(i32 inum) {
+  pthread_mutex_lock(&g_oftLock);
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    if (g_oft[i].inum != inum) continue;
+    memset(g_oft[i].map, 0, sizeof(g_oft[i].map));
+    g_oft[i].mapNext = 0;
+  }
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
-// Leave the size of the file as zero, until the user performs a write, or a
-// seek into the file.  On success, return the file's inum.  On failure, abort
+// Load the free-block bitmap into memory.  Bits past the end of the disk
+// are marked used, so they are never handed out
 // ============================================================================
-i32 bfsCreateFile(str fname) {
-
-  if (fname == NULL) FATAL(ENULLPTR);
+i32 bfsLoadBitmap() {
+  free(g_bitmap);
+  i64 bytes = (i64)g_super.numBitmapBlocks * BYTESPERBLOCK;
+  g_bmWords = (BLOCKSPERDISK + 63) / 64;
+  g_bitmap  = malloc(bytes);
+  if (g_bitmap == NULL) FATAL(ENOMEM);
+
+  for (i32 b = 0; b < g_super.numBitmapBlocks; ++b) {
+    bioRead(DBNBITMAP + b, (i8*)g_bitmap + (i64)b * BYTESPERBLOCK);
+  }
 
-  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
+  for (i64 b = BLOCKSPERDISK; b < (i64)g_bmWords * 64; ++b) {
+    g_bitmap[b / 64] |= 1ULL << (b % 64);
+  }
+  g_rotor = MINDBN;
+  g_numFree = g_freeSealed = 0;           // nothing queued on this disk
+  return 0;
+}
 
-  i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNDIR, buf);
 
-  Dir* dir = (Dir*)buf;
+// ============================================================================
+// Build the in-memory Directory index from the Directory blocks, and note
+// which inums are in use
+// ============================================================================
+i32 bfsLoadDir() {
+  free(g_dirIndex);
+  free(g_inumUsed);
+  g_dirIndexSize = 1;
+  while (g_dirIndexSize < 2 * NUMINODES) g_dirIndexSize <<= 1;
+  g_dirIndex = calloc(g_dirIndexSize, sizeof(DirIndex));
+  g_inumUsed = calloc(NUMINODES, 1);
+  if (g_dirIndex == NULL || g_inumUsed == NULL) FATAL(ENOMEM);
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {        // search Directory
-    if (strlen(dir->fname[inum]) == 0) {                // free slot
-      strcpy(dir->fname[inum], fname);
-      bioWrite(DBNDIR, dir);
-      bfsRefOFT(inum);
-      return inum;
+  i8 buf[BYTESPERBLOCK];
+  DirEnt* ents = (DirEnt*)buf;
+  for (i32 dbn = DBNDIR; dbn < DBNDIR + NUMDIRBLOCKS; ++dbn) {
+    bioRead(dbn, ents);
+    for (i32 slot = 0; slot < DIRPERBLOCK; ++slot) {
+      DirEnt* de = &ents[slot];
+      if (de->fname[0] == 0) continue;
+      if (de->inum < 0 || de->inum > MAXINUM) FATAL(EBADINUM);
+
+      DirIndex* di = dirIndexFind(de->fname);
+      memcpy(di->fname, de->fname, FNAMESIZE);
+      di->fname[FNAMESIZE - 1] = 0;
+      di->inum = de->inum;
+      di->dbn  = dbn;
+      di->slot = slot;
+      g_inumUsed[de->inum] = 1;
     }
   }
-
-  FATAL(EDIRFULL);                                      // Directory full
-  return 0;                                             // pacify compiler
+  return 0;
 }
 
 
 
 // ============================================================================
-// Dereference file with Inode number 'inum' in the Open File Table.  If
-// refcount reaches 0, free up that entry in the OFT
+// Read the Inodes blocks into the in-memory Inode table
 // ============================================================================
-i32 bfsDerefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  --g_oft[ofte].refs;
-  if (g_oft[ofte].refs == 0) {
-    g_oft[ofte].inum = 0;
-    g_oft[ofte].curs = 0;
+i32 bfsLoadInodes() {
+  free(g_inodes);
+  free(g_inodeDirty);
+  free(g_inodeLocks);
+  g_inodes     = malloc((size_t)NUMINODES * sizeof(Inode));
+  g_inodeDirty = calloc(NUMINODES, 1);
+  g_inodeLocks = malloc((size_t)NUMINODES * sizeof(pthread_rwlock_t));
+  if (g_inodes == NULL || g_inodeDirty == NULL || g_inodeLocks == NULL) {
+    FATAL(ENOMEM);
+  }
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    pthread_rwlock_init(&g_inodeLocks[inum], NULL);
+  }
+  memset(g_leaf, 0, sizeof(g_leaf));
+
+  i8 buf[BYTESPERBLOCK];
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    i32 slot = inum % INODESPERBLOCK;
+    if (slot == 0) bioRead(DBNINODES + inum / INODESPERBLOCK, buf);
+    memcpy(&g_inodes[inum], buf + slot * sizeof(Inode), sizeof(Inode));
   }
   return 0;
 }
@@ -102,301 +1239,521 @@ i32 bfsDerefOFT(i32 inum) {
 
 
 // ============================================================================
-// Extend file 'inum' out to FBN 'fbn'
+// Read the Super block and adopt its geometry for the mounted disk.  The
+// block size is not known yet, so DBN 0 is read raw, one minimal block.
+// The other images of a striped disk are then opened.  A disk formatted
+// before striping reads as one image
 // ============================================================================
-i32 bfsExtend(i32 inum, i32 fbn) {
-  i32 size = bfsGetSize(inum);
-  i32 fbnLast = (size + 1) / BYTESPERBLOCK;
-  for (i32 f = fbnLast; f <= fbn; ++f) {
-    bfsAllocBlock(inum, f);
-  }
+i32 bfsLoadSuper() {
+  i8 buf[MINBLOCKSIZE];
+  bioReadRaw(0, MINBLOCKSIZE, buf);
+
+  Super sb;
+  memcpy(&sb, buf, sizeof(Super));
+  if (sb.magic != BFSMAGIC) FATAL(ENODISK);
+  if (sb.numImages < 1) { sb.numImages = 1; sb.stripeBlocks = 1; }
+
+  g_super = sb;
+  if (NUMIMAGES > 1) bioStripe(NUMIMAGES, STRIPEBLOCKS, 0);
   return 0;
 }
 
 
 
 // ============================================================================
-// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
-// if not yet mapped
+// Lay out a disk of 'numBlocks' blocks of 'blockSize' bytes, with room for
+// 'numInodes' files, into 'g_super'.  The Super block is followed by the
+// Inodes, the free-block bitmap, the Directory blocks, and the journal (a
+// 32nd of the disk, within MINJNLBLOCKS .. MAXJNLBLOCKS); data blocks take
+// the rest.  The disk is striped over 'numImages' image files,
+// 'stripeBlocks' blocks at a time.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsFbnToDbn(i32 inum, i32 fbn) {
+i32 bfsMakeSuper(i32 numBlocks, i32 blockSize, i32 numInodes,
+                 i32 numImages, i32 stripeBlocks) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+  if (blockSize < MINBLOCKSIZE || blockSize > MAXBLOCKSIZE) FATAL(EBADGEOM);
+  if ((blockSize & (blockSize - 1)) != 0)                   FATAL(EBADGEOM);
+  if (numInodes < 1)                                        FATAL(EBADGEOM);
+  if (numImages < 1 || numImages > BIOMAXIMAGES)            FATAL(EBADGEOM);
+  if (stripeBlocks < 1)                                     FATAL(EBADGEOM);
 
-  Inode inode;
-  
-  bfsReadInode(inum, &inode);
+  i64 bitsPerBlock = (i64)blockSize * 8;
+  i32 inodesPerBlock = blockSize / sizeof(Inode);
+  i32 dirPerBlock    = blockSize / sizeof(DirEnt);
 
-  if (fbn < NUMDIRECT) {            // in direct[] array?
-    i32 dbn = inode.direct[fbn];
-    return (dbn == 0) ? ENODBN : dbn;
-  }
+  Super sb;
+  memset(&sb, 0, sizeof(Super));
+  sb.magic           = BFSMAGIC;
+  sb.blockSize       = blockSize;
+  sb.numBlocks       = numBlocks;
+  sb.numInodes       = numInodes;
+  sb.dbnInodes       = 1;
+  sb.numInodeBlocks  = (numInodes + inodesPerBlock - 1) / inodesPerBlock;
+  sb.dbnBitmap       = sb.dbnInodes + sb.numInodeBlocks;
+  sb.numBitmapBlocks = (numBlocks + bitsPerBlock - 1) / bitsPerBlock;
+  sb.dbnDir          = sb.dbnBitmap + sb.numBitmapBlocks;
+  sb.numDirBlocks    = (2 * numInodes + dirPerBlock - 1) / dirPerBlock;
+  sb.dbnJnl          = sb.dbnDir + sb.numDirBlocks;
+  sb.numJnlBlocks    = numBlocks / 32;
+  if (sb.numJnlBlocks < MINJNLBLOCKS) sb.numJnlBlocks = MINJNLBLOCKS;
+  if (sb.numJnlBlocks > MAXJNLBLOCKS) sb.numJnlBlocks = MAXJNLBLOCKS;
+  sb.firstData       = sb.dbnJnl + sb.numJnlBlocks;
+  sb.numImages       = numImages;
+  sb.stripeBlocks    = stripeBlocks;
+
+  if ((i64)sb.firstData >= numBlocks) FATAL(EBADGEOM);      // no data room
+
+  g_super = sb;
+  return 0;
+}
 
-  // fbn is not in direct, so check indirect block.  If it doesn't exist,
-  // then allocate an empty indirect block.  But return ENODBN for the
-  // caller to handle grabing a new data block.
 
-  if (inode.indirect == 0) {      // no indirect block yet allocated
-    i32 dbn = bfsFindFreeBlock();
-    inode.indirect = dbn;
-    bfsWriteInode(inum, &inode);
-    return ENODBN;
-  }
 
-  // Check the indirect block
+// ============================================================================
+// Lock Inode 'inum' for reading ('write' = 0), shared with other readers,
+// or for writing ('write' = 1), alone.  Guards the Inode and its Extent
+// blocks.  Hold at most one Inode lock at a time
+// ============================================================================
+i32 bfsLockInode(i32 inum, i32 write) {
 
-  i16 buf[NUMINDIRECT] = {0};
-  bioRead(inode.indirect, buf);
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
 
-  i32 dbn = buf[fbn - NUMDIRECT];
-  return (dbn == 0) ? ENODBN : dbn;
+  if (write) pthread_rwlock_wrlock(&g_inodeLocks[inum]);
+  else       pthread_rwlock_rdlock(&g_inodeLocks[inum]);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Convert FileDescriptor (user-visible) to Inum (internal)
+// Lookup 'fname' in the in-memory Directory index.  If found, return its
+// inum.  If not, return EFNF
 // ============================================================================
-i32 bfsFdToInum(i32 fd) { 
-  i32 inum = fd - INUMTOFD; 
-  if (inum < 0) FATAL(EBADINUM);
+i32 bfsLookupFile(str fname) {
+
+  if (fname == NULL) FATAL(ENULLPTR);
+
+  if (strlen(fname) > FNAMESIZE - 1) return EFNF;
+
+  pthread_mutex_lock(&g_dirLock);
+  DirIndex* di = dirIndexFind(fname);
+  i32 inum = (di->fname[0] == 0) ? EFNF : di->inum;
+  if (inum != EFNF) bfsRefOFT(inum);
+  pthread_mutex_unlock(&g_dirLock);
   return inum;
 }
 
 
 
-
 // ============================================================================
-// Find 'inum' in the Open File Table (OFT).  If not found, create an entry.
-// Return the index within the OFT.  On failure, EOFTFULL
+// Map up to 'n' FBNs of file 'inum', starting at 'fbn', with one Extent
+// lookup.  Set '*dbn' to the DBN holding 'fbn' and return how many of the
+// FBNs are stored in adjacent DBNs from there.  If 'fbn' is not mapped, set
+// '*dbn' to ENODBN and return how many FBNs are unmapped from there
 // ============================================================================
-i32 bfsFindOFTE(i32 inum) {
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == inum) return i;
+i32 bfsMapRange(i32 inum, i32 fbn, i32 n, i32* dbn) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+  if (n <= 0)         FATAL(ENEGNUMB);
+  if (dbn == NULL)    FATAL(ENULLPTR);
+
+  // Try the Extents recently used through this file's OFTE first
+
+  Extent ext;
+  i32 hit = 0;
+
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsOpenOFTE(inum);
+  if (ofte >= 0) {
+    OFTE* pofte = &g_oft[ofte];
+    for (i32 m = 0; m < OFTEMAPS && !hit; ++m) {
+      ext = pofte->map[m];
+      hit = ext.len > 0 && fbn >= ext.fbn && fbn < ext.fbn + ext.len;
+    }
   }
-  
-  // Not found, so look for an empty OFTE
+  pthread_mutex_unlock(&g_oftLock);
 
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == 0) {
-      g_oft[i].inum = inum;
-      g_oft[i].curs = 0;
-      g_oft[i].refs = 1;
-      return i;
+  if (hit) {
+    i32 run = ext.fbn + ext.len - fbn;
+    *dbn = ext.dbn + fbn - ext.fbn;
+    return (run < n) ? run : n;
+  }
+
+  Inode* inode = bfsGetInode(inum);
+
+  i32 idx = bfsExtFind(inode, fbn);
+  if (idx >= 0) {
+    bfsExtGet(inode, idx, &ext);
+    if (fbn < ext.fbn + ext.len) {        // inside this Extent
+      pthread_mutex_lock(&g_oftLock);     // remember it for next time
+      ofte = bfsOpenOFTE(inum);
+      if (ofte >= 0) {
+        OFTE* pofte = &g_oft[ofte];
+        pofte->map[pofte->mapNext] = ext;
+        pofte->mapNext = (pofte->mapNext + 1) % OFTEMAPS;
+      }
+      pthread_mutex_unlock(&g_oftLock);
+      i32 run = ext.fbn + ext.len - fbn;
+      *dbn = ext.dbn + fbn - ext.fbn;
+      return (run < n) ? run : n;
     }
   }
-  FATAL(EOFTFULL);      // no-return
-  return 0;             // pacify compiler
+
+  // Not mapped: the hole runs up to the start of the next Extent
+
+  *dbn = ENODBN;
+  if (idx + 1 < inode->numExtents) {
+    bfsExtGet(inode, idx + 1, &ext);
+    i32 hole = ext.fbn - fbn;
+    return (hole < n) ? hole : n;
+  }
+  return n;
 }
 
 
 
 // ============================================================================
-// Allocate the next free block from the Freelist.  Adjust Freelist
-// accordingly.  On success, return DBN.  FATAL otherwise
+// Give file 'inum', already referenced in the OFT, a File Descriptor of its
+// own, with its cursor at 0.  Return the File Descriptor.  On failure, abort
 // ============================================================================
-i32 bfsFindFreeBlock() {
-  i8 buf8[BYTESPERBLOCK] = {0};
-  bioRead(DBNSUPER, buf8);
-  Super* super = (Super*)buf8;
+i32 bfsOpenFd(i32 inum) {
 
-  i32 dbn = super->firstFree;
-  if (dbn == 0) FATAL(EDISKFULL);
+  if (inum < 0) FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
 
-  i16 buf16[I16SPERBLOCK] = {0};      // for next free block
-  bioRead(dbn, buf16);
+  pthread_mutex_lock(&g_oftLock);
+  for (i32 slot = 0; slot < NUMFDTENTRIES; ++slot) {
+    if (g_fdt[slot].inum >= 0) continue;
+    memset(&g_fdt[slot], 0, sizeof(FDTE));
+    g_fdt[slot].inum = inum;
+    pthread_mutex_unlock(&g_oftLock);
+    return slot + FIRSTFD;
+  }
+  FATAL(EFDTFULL);      // no-return
+  return 0;             // pacify compiler
+}
 
-  super->firstFree = buf16[0];        // new head of Freelist
 
-  bioWrite(DBNSUPER, buf8);           // update SuperBlock
 
-  return dbn;
+// ============================================================================
+// Return the index of the OFTE for file 'inum' if it is open, or -1 if not.
+// Unlike bfsFindOFTE, never creates an entry.  Caller holds g_oftLock
+// ============================================================================
+i32 bfsOpenOFTE(i32 inum) {
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    if (g_oft[i].inum == inum && g_oft[i].refs > 0) return i;
+  }
+  return -1;
 }
 
 
+
 // ============================================================================
-// Initialize the Freelist
+// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'.  An FBN in a
+// hole reads as zeros, without IO
 // ============================================================================
-i32 bfsInitFreeList() {
-  i16 buf[I16SPERBLOCK] = {0};
-  i32 ret = 0;
+i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
 
-  for (int dbn = NUMMETA; dbn < BLOCKSPERDISK - 1; ++dbn) {
-    buf[0] = dbn + 1;
-    bioWrite(dbn, (i8*)buf);
-  }
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
 
-  buf[0] = 0;
-  bioWrite(BLOCKSPERDISK - 1, (i8*)buf);      // end of Freelist
+  i64 t0 = prfBegin(PRFBFSREAD);
 
-  return ret;
-}
+  i32 dbn = bfsFbnToDbn(inum, fbn);
 
+  if (dbn == ENODBN) memset(buf, 0, BYTESPERBLOCK);
+  else               bioRead(dbn, buf);
+  prfEnd(PRFBFSREAD, t0, BYTESPERBLOCK, 1);
+  return 0;
+}
 
 
 // ============================================================================
-// Write the initial Dir block, of all zeroes, into DBN 2
+// Note that FBNs 'fbn' .. 'fbn' + 'n' - 1 of file 'inum' were just read on
+// File Descriptor 'fd', and read ahead if the descriptor is streaming.  A
+// read that starts where the last one ended, or in its last block, is
+// sequential: the window opens at RAMINBLOCKS and doubles each time a read
+// moves on to new blocks, up to RAMAXBLOCKS or a quarter of the cache.
+// Any other read closes it.  Once less than half a window is read ahead
+// of the reader, the next window's worth is brought into the cache with
+// one bioReadAhead per Extent.  Caller holds the file's Inode lock
 // ============================================================================
-i32 bfsInitDir(FILE* fp) {
-  if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNDIR, buf);
-}
+i32 bfsReadAhead(i32 fd, i32 inum, i32 fbn, i32 n) {
+
+  bfsFdToInum(fd);                       // abort if 'fd' is not open
+  if (n <= 0) return 0;
+
+  i32 last = fbn + n - 1;                // last FBN read
+  i32 from = 0;
+  i32 to   = 0;                          // read ahead FBNs 'from' .. 'to'-1
+
+  i32 maxWin = bioCacheBlocks() / 4;     // what bioReadAhead will take
+  if (maxWin > RAMAXBLOCKS) maxWin = RAMAXBLOCKS;
+  if (maxWin < 1) return 0;
+
+  pthread_mutex_lock(&g_oftLock);
+  FDTE* fdte = &g_fdt[fd - FIRSTFD];
+  if (fbn == fdte->raNext || fbn == fdte->raNext - 1) {
+    if (fdte->raWin == 0) {
+      fdte->raWin = RAMINBLOCKS;
+    } else if (last >= fdte->raNext) {
+      fdte->raWin *= 2;
+    }
+    if (fdte->raWin > maxWin) fdte->raWin = maxWin;
+  } else {
+    fdte->raWin = 0;
+    fdte->raEnd = 0;
+  }
+  fdte->raNext = last + 1;
 
+  if (fdte->raWin > 0 && fdte->raEnd - (last + 1) < fdte->raWin / 2) {
+    from = (fdte->raEnd > last + 1) ? fdte->raEnd : last + 1;
+    to   = last + 1 + fdte->raWin;
+    fdte->raEnd = to;
+  }
+  pthread_mutex_unlock(&g_oftLock);
 
+  // Stay inside the file, and skip any FBN not yet mapped
 
-// ============================================================================
-// Write the initial Inodes block, of all zeroes, into DBN 1
-// ============================================================================
-i32 bfsInitInodes(FILE* fp) {
-  if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNINODES, buf);
+  i32 size = bfsGetSize(inum);
+  i32 eof  = (size == 0) ? 0 : (size - 1) / BYTESPERBLOCK + 1;
+  if (to > eof) to = eof;
+  if (from >= to) return 0;
+
+  i64 t0 = prfBegin(PRFBFSREADAHEAD);
+  i32 blocks = to - from;
+  while (from < to) {
+    i32 dbn = 0;
+    i32 run = bfsMapRange(inum, from, to - from, &dbn);
+    if (dbn != ENODBN) bioReadAhead(dbn, run);
+    from += run;
+  }
+  prfEnd(PRFBFSREADAHEAD, t0, (i64)blocks * BYTESPERBLOCK, blocks);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Initialize the Open File Table to all zeroes
+// Read 'n' FBNs of file 'inum', starting at 'fbn', into 'buf'.  Each run of
+// FBNs within one Extent is read with a single bioReadRange; each run in a
+// hole is zero-filled, without IO
 // ============================================================================
-i32 bfsInitOFT() {
-  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
-    g_oft[i].inum = 0;
-    g_oft[i].curs = 0;
-    g_oft[i].refs = 0;
+i32 bfsReadRange(i32 inum, i32 fbn, i32 n, i8* buf) {
+
+  if (n <= 0)               FATAL(ENEGNUMB);
+  if (fbn + n - 1 > MAXFBN) FATAL(EBADFBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+
+  i64 t0 = prfBegin(PRFBFSREADRANGE);
+
+  i32 f = 0;
+  while (f < n) {
+    i32 dbn = 0;
+    i32 run = bfsMapRange(inum, fbn + f, n - f, &dbn);
+
+    i8* dst = buf + (i64)f * BYTESPERBLOCK;
+    if (dbn == ENODBN) memset(dst, 0, (i64)run * BYTESPERBLOCK);  // hole
+    else               bioReadRange(dbn, run, dst);
+    f += run;
   }
+  prfEnd(PRFBFSREADRANGE, t0, (i64)n * BYTESPERBLOCK, n);
   return 0;
 }
 
 
+
 // ============================================================================
-// Write the initial Super block into DBN 0
+// Copy the Inode whose number is 'inum', from the in-memory Inode table,
+// into 'inode'.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsInitSuper(FILE* fp) {
-
-  if (fp == NULL) FATAL(ENULLPTR);
-
-  Super sb;
-  sb.numBlocks = BLOCKSPERDISK;           // eg: 100
-  sb.numInodes = NUMINODES;               // eg: 8
-  sb.firstFree = NUMMETA;                 // eg: 3
+i32 bfsReadInode(i32 inum, Inode* inode) {
 
-  i8 buf[BYTESPERBLOCK] = {0};
-  memcpy(buf, &sb, sizeof(Super));
+  if (inode == NULL)  FATAL(ENULLPTR);
 
-  return bioWrite(DBNSUPER, buf);
+  memcpy(inode, bfsGetInode(inum), sizeof(Inode));
+  return 0;
 }
 
 
 
 // ============================================================================
-// Convert between inum (internal) and FileDescriptor (user-visible)
+// Reference file with Inode number 'inum' in the Open File Table
 // ============================================================================
-i32 bfsInumToFd(i32 inum) { return inum + INUMTOFD; }
+i32 bfsRefOFT(i32 inum) {
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsFindOFTE(inum);
+  ++g_oft[ofte].refs;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
+
 
 
 // ============================================================================
-// Lookup 'fname' in the Directory.  If found, return its inum.  If not,
-// return EFNF
+// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
 // ============================================================================
-i32 bfsLookupFile(str fname) {
+i32 bfsSetCursor(i32 fd, i32 newCurs) {
 
-  if (fname == NULL) FATAL(ENULLPTR);
+  bfsFdToInum(fd);                       // abort if 'fd' is not open
 
-  i8 buf[BYTESPERBLOCK] = {0};
+  pthread_mutex_lock(&g_oftLock);
+  g_fdt[fd - FIRSTFD].curs = newCurs;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
 
-  bioRead(DBNDIR, buf);
 
-  Dir* dir = (Dir*)buf;
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    if (strcmp(fname, dir->fname[inum]) == 0) {
-      bfsRefOFT(inum);
-      return inum;
-    }
-  }
+// ============================================================================
+// Write Inode 'inum', if dirty, to its Inodes block in the caller's journal
+// operation.  The block's other Inodes are copied as they stand, without
+// their locks: one caught part way through an operation is written again
+// by that operation before it ends, and no commit falls in between.  The
+// caller holds the file's Inode write lock
+// ============================================================================
+i32 bfsSyncInode(i32 inum) {
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (!g_inodeDirty[inum]) return 0;
 
-  return EFNF;
+  i64 t0    = prfBegin(PRFBFSSYNCINODE);
+  i32 first = inum - inum % INODESPERBLOCK;
+  i32 last  = first + INODESPERBLOCK;
+  if (last > NUMINODES) last = NUMINODES;
 
+  pthread_mutex_lock(&g_syncLock);
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  memcpy(buf, &g_inodes[first], (last - first) * sizeof(Inode));
+  jnlWrite(DBNINODES + first / INODESPERBLOCK, buf);
+  g_inodeDirty[inum] = 0;
+  pthread_mutex_unlock(&g_syncLock);
+  prfEnd(PRFBFSSYNCINODE, t0, BYTESPERBLOCK, 1);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'
+// Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
-i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
-
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
-
-  i32 dbn = bfsFbnToDbn(inum, fbn);
+i32 bfsTell(i32 fd) {
+  bfsFdToInum(fd);                       // abort if 'fd' is not open
 
-  bioRead(dbn, buf);
-  return 0;
+  pthread_mutex_lock(&g_oftLock);
+  i32 curs = g_fdt[fd - FIRSTFD].curs;
+  pthread_mutex_unlock(&g_oftLock);
+  return curs;
 }
 
 
+
 // ============================================================================
-// Read the Inodes block.  Extract and return the Inode whose number is 'inum'.
-// On success, return 0.  On failure, abort
+// Set the size of file 'inum' to 'size' bytes.  Growing just moves the end
+// of file: the gap is a hole, read as zeros.  Shrinking unmaps every block
+// wholly past the new end, then drops the Extent blocks, and the pointer
+// blocks above them, no longer needed.  All of these are queued for
+// bfsCommit to free in one batch, once the shrunken Inode is committed.
+// The tail of the last block kept is zeroed, so a later grow reads zeros
+// there too.  The caller holds the file's Inode write lock.  On success,
+// return 0
 // ============================================================================
-i32 bfsReadInode(i32 inum, Inode* inode) {
+i32 bfsTruncate(i32 inum, i32 size) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
-  if (inode == NULL)  FATAL(ENULLPTR);
+  if (size < 0)       FATAL(ENEGNUMB);
 
-  i8 buf[BYTESPERBLOCK] = {0};
+  Inode* inode = bfsGetInode(inum);
+  if (size >= inode->size) return bfsSetSize(inum, size);
 
-  bioRead(DBNINODES, buf);
+  i64 t0 = prfBegin(PRFBFSTRUNCATE);
+  i32 freed = 0;                          // data blocks unmapped
 
-  Inode* inodes = (Inode*)buf;
+  i32 keep = (i32)(((i64)size + BYTESPERBLOCK - 1) / BYTESPERBLOCK);
+  i32 tail = size % BYTESPERBLOCK;        // bytes kept in the last block
 
-  memcpy(inode, &inodes[inum], sizeof(Inode));
-  return 0;
-}
+  if (tail != 0) {
+    i32 dbn = 0;
+    bfsMapRange(inum, keep - 1, 1, &dbn);
+    if (dbn != ENODBN) {
+      i8 buf[BYTESPERBLOCK];
+      bfsRead(inum, keep - 1, buf);
+      memset(buf + tail, 0, BYTESPERBLOCK - tail);
+      bfsWrite(inum, keep - 1, buf);
+    }
+  }
 
+  // Cut Extents from the end.  Their data blocks leave the cache at once:
+  // nobody may write them back
+
+  i32 n = inode->numExtents;
+  while (n > 0) {
+    Extent ext;
+    bfsExtGet(inode, n - 1, &ext);
+    if (ext.fbn + ext.len <= keep) break;
+
+    i32 kept = (ext.fbn < keep) ? keep - ext.fbn : 0;
+    freeQueue(ext.dbn + kept, ext.len - kept, 0);
+    bioDiscard(ext.dbn + kept, ext.len - kept);
+    freed += ext.len - kept;
+    if (kept > 0) {
+      ext.len = kept;
+      bfsExtPut(inode, n - 1, &ext);
+      break;
+    }
+    --n;
+  }
 
+  if (n < inode->numExtents) {
+    inode->numExtents = n;
+    extTrim(inode);
+    pthread_mutex_lock(&g_leafLock);      // cached paths may be freed
+    memset(g_leaf, 0, sizeof(g_leaf));
+    pthread_mutex_unlock(&g_leafLock);
+  }
 
-// ============================================================================
-// Reference file with Inode number 'inum' in the Open File Table
-// ============================================================================
-i32 bfsRefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  ++g_oft[ofte].refs;
+  inode->size = size;
+  bfsDirtyInode(inum);
+  bfsInvalMaps(inum);                     // Extents changed
+  prfEnd(PRFBFSTRUNCATE, t0, (i64)freed * BYTESPERBLOCK, freed);
   return 0;
 }
 
 
 
 // ============================================================================
-// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
+// Release the lock bfsLockInode took on Inode 'inum'
 // ============================================================================
-i32 bfsSetCursor(i32 inum, i32 newCurs) {
+i32 bfsUnlockInode(i32 inum) {
 
-  if (inum < 0) FATAL(EBADINUM);
+  if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
 
-  i32 ofte = bfsFindOFTE(inum);
-  g_oft[ofte].curs = newCurs;
+  pthread_rwlock_unlock(&g_inodeLocks[inum]);
   return 0;
 }
 
 
 
 // ============================================================================
-// Return the cursor position for the file open on File Descriptor 'fd'
+// Return a pointer to Inode 'inum' in the in-memory Inode table.  Callers
+// that change it must call bfsDirtyInode
 // ============================================================================
-i32 bfsTell(i32 fd) {
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  return g_oft[ofte].curs;
+Inode* bfsGetInode(i32 inum) {
+
+  if (inum < 0)        FATAL(EBADINUM);
+  if (inum > MAXINUM)  FATAL(EBADINUM);
+  if (g_inodes == NULL) FATAL(ENODISK);
+
+  return &g_inodes[inum];
 }
 
 
@@ -409,10 +1766,7 @@ i32 bfsGetSize(i32 inum) {
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
 
-  Inode inode;
-  bfsReadInode(inum, &inode);
-
-  return inode.size;
+  return bfsGetInode(inum)->size;
 }
 
 
@@ -425,31 +1779,73 @@ i32 bfsSetSize(i32 inum, i32 size) {
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
 
-  Inode inode;
-  bfsReadInode(inum, &inode);
-  
-  inode.size = size;
-  bfsWriteInode(inum, &inode);
+  bfsGetInode(inum)->size = size;
+  bfsDirtyInode(inum);
   return 0;
 }
 
 
 
 // ============================================================================
-// Update the Inodes block on disk with the info in 'inode'
+// Write 'buf' into FBN 'fbn' of file 'inum', through the buffer cache.  The
+// block reaches the disk later: see bio.c
 // ============================================================================
-i32 bfsWriteInode(i32 inum, Inode* inode) {
+i32 bfsWrite(i32 inum, i32 fbn, i8* buf) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
-  if (inode == NULL)  FATAL(ENULLPTR);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
 
-  i8 buf[BYTESPERBLOCK];
-  bioRead(DBNINODES, buf);
-  Inode* inodes = (Inode*)buf;
-  memcpy(&inodes[inum], inode, sizeof(Inode));
-  bioWrite(DBNINODES, buf);
+  i64 t0 = prfBegin(PRFBFSWRITE);
+
+  i32 dbn = bfsFbnToDbn(inum, fbn);
+  if (dbn == ENODBN) FATAL(EBADDBN);
+
+  bioWrite(dbn, buf);
+  prfEnd(PRFBFSWRITE, t0, BYTESPERBLOCK, 1);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Update the in-memory Inode table with the info in 'inode'.  It reaches the
+// Inodes block on the next bfsSyncInode
+// ============================================================================
+i32 bfsWriteInode(i32 inum, Inode* inode) {
+
+  if (inode == NULL)  FATAL(ENULLPTR);
 
+  memcpy(bfsGetInode(inum), inode, sizeof(Inode));
+  bfsDirtyInode(inum);
   return 0;
 }
 
+
+
+// ============================================================================
+// Write 'n' FBNs of file 'inum', starting at 'fbn', from 'buf'.  The FBNs
+// must already be allocated.  Each run of FBNs within one Extent is written
+// with a single bioWriteRange
+// ============================================================================
+i32 bfsWriteRange(i32 inum, i32 fbn, i32 n, i8* buf) {
+
+  if (n <= 0)               FATAL(ENEGNUMB);
+  if (fbn + n - 1 > MAXFBN) FATAL(EBADFBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+
+  i64 t0 = prfBegin(PRFBFSWRITERANGE);
+
+  i32 f = 0;
+  while (f < n) {
+    i32 dbn = 0;
+    i32 run = bfsMapRange(inum, fbn + f, n - f, &dbn);
+    if (dbn == ENODBN) FATAL(EBADDBN);
+
+    bioWriteRange(dbn, run, buf + (i64)f * BYTESPERBLOCK);
+    f += run;
+  }
+  prfEnd(PRFBFSWRITERANGE, t0, (i64)n * BYTESPERBLOCK, n);
+  return 0;
+}
@@ -12,81 +12,183 @@
 #include "alias.h"
 #include "bio.h"
 #include "errors.h"
+#include "jnl.h"
+
+// The geometry of a BFS disk is chosen by fsFormat and kept in its Super
+// block.  Once mounted, these read the geometry of the mounted disk
+
+#define BYTESPERBLOCK (g_super.blockSize)
+#define BLOCKSPERDISK (g_super.numBlocks)
+#define NUMINODES     (g_super.numInodes)
+#define MAXINUM       (NUMINODES - 1)
+#define DBNINODES     (g_super.dbnInodes)
+#define DBNBITMAP     (g_super.dbnBitmap)
+#define DBNDIR        (g_super.dbnDir)
+#define NUMDIRBLOCKS  (g_super.numDirBlocks)
+#define DBNJNL        (g_super.dbnJnl)
+#define NUMJNLBLOCKS  (g_super.numJnlBlocks)
+#define NUMMETA       (g_super.firstData)
+#define NUMIMAGES     (g_super.numImages)
+#define STRIPEBLOCKS  (g_super.stripeBlocks)
+#define MINDBN        NUMMETA
+
+#define INODESPERBLOCK ((i32)(BYTESPERBLOCK / sizeof(Inode)))
+#define EXTPERBLOCK   ((i32)(BYTESPERBLOCK / sizeof(Extent)))
+#define DIRPERBLOCK   ((i32)(BYTESPERBLOCK / sizeof(DirEnt)))
+#define PTRSPERBLOCK  ((i32)(BYTESPERBLOCK / sizeof(i32)))
+#define MAXEXTENTS    ((i64)NUMEXTENTS + EXTPERBLOCK                         \
+                     + (i64)PTRSPERBLOCK * EXTPERBLOCK                       \
+                     + (i64)PTRSPERBLOCK * PTRSPERBLOCK * EXTPERBLOCK)
+#define MAXFBN        (INT32_MAX / BYTESPERBLOCK)
+#define MAXFSIZE      ((i64)MAXFBN * BYTESPERBLOCK)   // most bytes in a file
 
-#define BYTESPERBLOCK 512
-#define I16SPERBLOCK  256
-#define BLOCKSPERDISK 100
-#define BYTESPERDISK  (BLOCKSPERDISK * BYTESPERBLOCK)
-#define NUMINODES     8
-#define MAXINUM       NUMINODES - 1
-#define NUMMETA       3
-#define MINDBN        3
 #define BFSDISK       "BFSDISK"
-#define NUMDIRECT     5
-#define NUMINDIRECT   BYTESPERBLOCK / sizeof(i16)
-#define MAXFBN        NUMDIRECT + NUMINDIRECT
+#define BFSMAGIC      0x42465332  // "BFS2"
+#define DBNSUPER      0
+#define MINBLOCKSIZE  512
+#define MAXBLOCKSIZE  65536
+#define NUMEXTENTS    3
+#define MINJNLBLOCKS  8           // journal size bounds, see bfsMakeSuper
+#define MAXJNLBLOCKS  1024
 #define FNAMESIZE     16
 
-#define DBNSUPER      0
-#define DBNINODES     1
-#define DBNDIR        2
+#define DEFBLOCKS     100         // geometry of the P5 test disk
+#define DEFBLOCKSIZE  512
+#define DEFINODES     8
 
-#define INUMTOFD      5
+#define FIRSTFD       5           // File Descriptor of FDT slot 0
 
 #define NUMOFTENTRIES 20
+#define NUMFDTENTRIES 64
+#define OFTEMAPS      4           // # of Extents cached per OFTE
+#define RAMINBLOCKS   4           // readahead window bounds, in blocks
+#define RAMAXBLOCKS   64
 
 
 typedef struct {          // SuperBlock
-  i16 numBlocks;          // total # of blocks in BFSDISK = 1,000
-  i16 numInodes;          // total # of inodes = 8
-  i16 firstFree;          // DBN of first free block
+  u32 magic;              // BFSMAGIC
+  i32 blockSize;          // # of bytes per block, 512 .. 64K
+  i32 numBlocks;          // total # of blocks in BFSDISK
+  i32 numInodes;          // total # of inodes
+  i32 dbnInodes;          // DBN of the first Inodes block
+  i32 numInodeBlocks;     // # of Inodes blocks
+  i32 dbnBitmap;          // DBN of the first free-block bitmap block
+  i32 numBitmapBlocks;    // # of bitmap blocks
+  i32 dbnDir;             // DBN of the first Directory block
+  i32 numDirBlocks;       // # of Directory blocks
+  i32 dbnJnl;             // DBN of the first journal block
+  i32 numJnlBlocks;       // # of journal blocks
+  i32 firstData;          // DBN of the first data block
+  i32 numImages;          // # of image files striped over.  0 => 1
+  i32 stripeBlocks;       // # of blocks per stripe unit, see bioStripe
 } Super;
 
 
 
+typedef struct {          // Extent: FBNs held in adjacent DBNs
+  i32 fbn;                // first FBN of the run
+  i32 dbn;                // DBN holding 'fbn'
+  i32 len;                // # of blocks in the run
+} Extent;
+
+
+
 typedef struct {          // Inode
   i32 size;               // # of bytes in file
-  i16 direct[NUMDIRECT];  // DBNs for first 5 FBNs
-  i16 indirect;           // DBN of the indirect table
+  i32 numExtents;         // # of Extents mapping the file
+  Extent extent[NUMEXTENTS]; // first Extents, sorted by FBN
+  i32 indirect;           // DBN of block holding further Extents
+  i32 dindirect;          // DBN of block of DBNs of Extent blocks
+  i32 tindirect;          // DBN of block of DBNs of double-indirect blocks
 } Inode;
 
 
 
-typedef struct {          // Dir
-  char fname[NUMINODES][FNAMESIZE];
-} Dir;
+// The Directory blocks form a hash table: a name lives in the block at
+// DBNDIR + (hash % NUMDIRBLOCKS), or the next block along with room.
+// fsFormat gives it twice as many entries as there are Inodes
+
+typedef struct {          // Directory entry
+  char fname[FNAMESIZE];  // file name.  "" => entry unused
+  i32  inum;              // inum of file
+} DirEnt;
 
 
 typedef struct {          // Open File Table Entry
   i32 inum;               // inum of file. O => slot not used
-  i32 refs;               // # processes fsOpen'd this file
-  i32 curs;               // cursor into file
+  i32 refs;               // # File Descriptors open on this file
+  Extent map[OFTEMAPS];   // recently used Extents.  len 0 => unused
+  i32 mapNext;            // next 'map' slot to replace
 } OFTE;
 
-OFTE g_oft[NUMOFTENTRIES];
+
+typedef struct {          // File Descriptor Table Entry: one per fsOpen
+  i32 inum;               // inum of file.  -1 => slot not used
+  i32 curs;               // cursor into file, private to this descriptor
+  i32 raNext;             // FBN a sequential read would start at next
+  i32 raWin;              // readahead window, in blocks.  0 => random
+  i32 raEnd;              // FBN after the last one read ahead
+} FDTE;
+
+extern FDTE  g_fdt[NUMFDTENTRIES];
+extern OFTE  g_oft[NUMOFTENTRIES];
+extern Super g_super;
 
 i32 bfsAllocBlock(i32 inum, i32 fbn);
+i32 bfsAllocBlocks(i32 inum, i32 fbn, i32 n);
+i32 bfsAllocRange(i32 inum, i32 fbn, i32 n);
+i32 bfsAllocRun(i32 goal, i32 want, i32* got);
+i32 bfsBitmapMark(i32 dbn, i32 n, i32 used);
+i32 bfsBitmapScan(i32 from, i32 used);
+i32 bfsCloseFd(i32 fd);
+i32 bfsCommit();
 i32 bfsCreateFile(str fname);
+i32 bfsDeleteFile(str fname);
 i32 bfsDerefOFT(i32 inum);
-i32 bfsExtend(i32 inum, i32 fbn);
+u32 bfsDirHash(str fname);
+i32 bfsDirtyInode(i32 inum);
+i32 bfsExtDelete(Inode* inode, i32 idx);
+i32 bfsExtFind(Inode* inode, i32 fbn);
+i32 bfsExtGet(Inode* inode, i32 idx, Extent* ext);
+i32 bfsExtInsert(Inode* inode, i32 idx, Extent* ext);
+i32 bfsExtPut(Inode* inode, i32 idx, Extent* ext);
 i32 bfsFbnToDbn(i32 inum,   i32 fbn);
 i32 bfsFdToInum(i32 fd);
 i32 bfsFindFreeBlock();
 i32 bfsFindOFTE(i32 inum);
+i32 bfsFlushFile(i32 inum);
+Inode* bfsGetInode(i32 inum);
 i32 bfsGetSize(i32 inum);
+i32 bfsInitBitmap();
 i32 bfsInitDir();
-i32 bfsInitFreeList();
 i32 bfsInitInodes();
 i32 bfsInitOFT();
-i32 bfsInitSuper(FILE* fp);
-i32 bfsInumToFd(i32 inum);
+i32 bfsInitSuper();
+i32 bfsInvalMaps(i32 inum);
+i32 bfsLoadBitmap();
+i32 bfsLoadDir();
+i32 bfsLoadInodes();
+i32 bfsLoadSuper();
+i32 bfsLockInode(i32 inum, i32 write);
 i32 bfsLookupFile(str fname);
+i32 bfsMakeSuper(i32 numBlocks, i32 blockSize, i32 numInodes,
+                 i32 numImages, i32 stripeBlocks);
+i32 bfsMapRange(i32 inum, i32 fbn, i32 n, i32* dbn);
+i32 bfsOpenFd(i32 inum);
+i32 bfsOpenOFTE(i32 inum);
 i32 bfsRead(i32 inum, i32 fbn, i8* buf);
+i32 bfsReadAhead(i32 fd, i32 inum, i32 fbn, i32 n);
+i32 bfsReadRange(i32 inum, i32 fbn, i32 n, i8* buf);
 i32 bfsReadInode(i32 inum, Inode* inode);
 i32 bfsRefOFT(i32 inum);
-i32 bfsSetCursor(i32 inum, i32 newCurs);
+i32 bfsSetCursor(i32 fd, i32 newCurs);
 i32 bfsSetSize(i32 inum, i32 size);
+i32 bfsSyncInode(i32 inum);
 i32 bfsTell(i32 fd);
+i32 bfsTruncate(i32 inum, i32 size);
+i32 bfsUnlockInode(i32 inum);
+i32 bfsWrite(i32 inum, i32 fbn, i8* buf);
 i32 bfsWriteInode(i32 inum, Inode* inode);
+i32 bfsWriteRange(i32 inum, i32 fbn, i32 n, i8* buf);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,401 @@
+// ============================================================================
+// bfstest.c : check the BFS disk's own structures, through the bfs* layer,
+// after fs* calls have changed them
+// ============================================================================
+
+#include <assert.h>       // assert
+#include <stdio.h>        // fflush, freopen
+#include <sys/wait.h>     // waitpid
+#include <unistd.h>       // fork, _exit
+
+#include "bfs.h"
+#include "bfstest.h"
+#include "fs.h"
+
+#define BLOCKSIZE 512     // block size of the scratch disks
+
+// ============================================================================
+// Count the blocks whose bitmap bit disagrees with the mounted disk's
+// Inodes: in use but owned by nothing (leaked), free but owned, or owned
+// twice.  The metadata area, each file's data blocks, and its Extent and
+// pointer blocks are owned.  Nothing else may be running
+// ============================================================================
+static i32 fsck() {
+  u8* owned = calloc(BLOCKSPERDISK, 1);
+  assert(owned != NULL);
+  i32* ptr = malloc(BYTESPERBLOCK);
+  i32* mid = malloc(BYTESPERBLOCK);
+  assert(ptr != NULL && mid != NULL);
+
+  for (i32 dbn = 0; dbn < NUMMETA; ++dbn) owned[dbn] = 1;
+
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    Inode* inode = bfsGetInode(inum);
+    for (i32 idx = 0; idx < inode->numExtents; ++idx) {
+      Extent ext;
+      bfsExtGet(inode, idx, &ext);
+      for (i32 b = 0; b < ext.len; ++b) ++owned[ext.dbn + b];
+    }
+
+    if (inode->indirect) ++owned[inode->indirect];
+    if (inode->dindirect) {
+      ++owned[inode->dindirect];
+      bioRead(inode->dindirect, ptr);
+      for (i32 p = 0; p < PTRSPERBLOCK; ++p) if (ptr[p]) ++owned[ptr[p]];
+    }
+    if (inode->tindirect) {
+      ++owned[inode->tindirect];
+      bioRead(inode->tindirect, mid);
+      for (i32 m = 0; m < PTRSPERBLOCK; ++m) {
+        if (mid[m] == 0) continue;
+        ++owned[mid[m]];
+        bioRead(mid[m], ptr);
+        for (i32 p = 0; p < PTRSPERBLOCK; ++p) if (ptr[p]) ++owned[ptr[p]];
+      }
+    }
+  }
+
+  i32 bad = 0;
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+    i32 used = bfsBitmapScan(dbn, 1) == dbn;
+    if (owned[dbn] > 1 || used != owned[dbn]) ++bad;
+  }
+
+  free(mid);
+  free(ptr);
+  free(owned);
+  return bad;
+}
+
+
+
+// ============================================================================
+// Return the number of blocks the bitmap of the mounted disk marks in use
+// ============================================================================
+static i32 usedBlocks() {
+  i32 used = 0;
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+    used += bfsBitmapScan(dbn, 1) == dbn;
+  }
+  return used;
+}
+
+
+
+// ============================================================================
+// TEST 10 : Crash inside one write.  On a scratch disk, two files are
+//           written a block at a time, interleaved, the rest of the disk
+//           is filled, and one of the two deleted: free space is 300
+//           small holes.  A third file is written in one fsWrite of 400
+//           blocks, taking a run per hole: more Extents than the journal
+//           of a 12-block cache can hold, so the write commits in several
+//           transactions, until the disk fills and the child aborts.
+//           Remounted, the bitmap must match the Inodes, and the file hold
+//           what was written, up to its size
+//           0 mismatched blocks ; 512*(b % 100 + 1) for block b
+// ============================================================================
+void test10() {
+  static i8 data[400 * BLOCKSIZE];
+  static i8 back[400 * BLOCKSIZE];
+
+  for (int b = 0; b < 400; ++b) {
+    memset(data + b * BLOCKSIZE, b % 100 + 1, BLOCKSIZE);
+  }
+
+  scratchIn();
+  fsFormat(2000, BLOCKSIZE, 32);
+
+  fflush(stdout);                         // the child closes its copy
+  pid_t pid = fork();
+  if (pid == 0) {
+    assert(freopen("/dev/null", "r", stdin)  != NULL);  // FATAL exits at
+    assert(freopen("/dev/null", "w", stdout) != NULL);  // once, quietly
+    bioCacheSize(12);                     // a journal of 6 blocks
+    fsMount();
+    i32 a = fsCreate("A");
+    i32 b = fsCreate("B");
+    for (int k = 0; k < 300; ++k) {
+      fsWrite(a, BLOCKSIZE, data);
+      fsWrite(b, BLOCKSIZE, data);
+    }
+    i32 f = fsCreate("FILL");
+    i32 left = 0;
+    for (i32 dbn = MINDBN; dbn < BLOCKSPERDISK; ++dbn) {
+      left += bfsBitmapScan(dbn, 0) == dbn;
+    }
+    while (left > 0) {
+      i32 n = (left < 400) ? left : 400;
+      fsWrite(f, n * BLOCKSIZE, data);
+      left -= n;
+    }
+    fsClose(a);
+    fsClose(b);
+    fsClose(f);
+    fsDelete("B");
+
+    i32 c = fsCreate("C");
+    fsWrite(c, sizeof(data), data);       // EDISKFULL: the crash
+    _exit(0);
+  }
+  assert(pid > 0);
+  waitpid(pid, NULL, 0);
+
+  fsMount();
+  checkEqual(10, "mismatched blocks", 0, fsck());
+
+  i32 c    = fsOpen("C");
+  i32 size = (c < 0) ? 0 : fsSize(c);
+  if (size > 0) fsRead(c, size, back);
+  checkEqual(10, "memcmp", 0, memcmp(back, data, size));
+  if (c >= 0) fsClose(c);
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 11 : Past the double-indirect boundary.  On a scratch disk, two files
+//           are written a block at a time, interleaved, so each block is
+//           an Extent of its own: 100 Extents each, beyond the NUMEXTENTS
+//           in the Inode and the EXTPERBLOCK in the indirect block.  The
+//           disk is remounted, and both files read back
+//           dindirect used ; 512*(k % 50 + 1) and 512*(k % 50 + 51)
+// ============================================================================
+void test11() {
+  static i8 data[2][100 * BLOCKSIZE];
+  static i8 back[100 * BLOCKSIZE];
+  i32 size = sizeof(back);
+
+  for (int k = 0; k < 100; ++k) {
+    memset(data[0] + k * BLOCKSIZE, k % 50 + 1,  BLOCKSIZE);
+    memset(data[1] + k * BLOCKSIZE, k % 50 + 51, BLOCKSIZE);
+  }
+
+  scratchIn();
+  fsFormat(1000, BLOCKSIZE, 8);
+  fsMount();
+  i32 fd[2] = {fsCreate("A"), fsCreate("B")};
+  for (int k = 0; k < 100; ++k) {
+    fsWrite(fd[0], BLOCKSIZE, data[0] + k * BLOCKSIZE);
+    fsWrite(fd[1], BLOCKSIZE, data[1] + k * BLOCKSIZE);
+  }
+  fsClose(fd[0]);
+  fsClose(fd[1]);
+  fsUnmount();
+
+  fsMount();
+  str names[2] = {"A", "B"};
+  for (int f = 0; f < 2; ++f) {
+    Inode* inode = bfsGetInode(bfsLookupFile(names[f]));
+    checkEqual(11, "# Extents", 100, inode->numExtents);
+    checkEqual(11, "dindirect used", 1, inode->dindirect != 0);
+
+    i32 fd = fsOpen(names[f]);
+    memset(back, 0, size);
+    checkEqual(11, "bytes read", size, fsRead(fd, size, back));
+    checkEqual(11, "memcmp", 0, memcmp(back, data[f], size));
+    fsClose(fd);
+  }
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 12 : Sparse file.  On a scratch disk, a new file is seeked 100 blocks
+//           past its end and written 20 bytes there, then 10 more bytes
+//           are written with fsPwrite 200 blocks further on.  The size
+//           follows the last byte written, the holes read as zeros, and
+//           just the 2 blocks written are allocated
+//           0 blocks for the seek, 2 in all ; 20*7 at block 100, byte 10 ;
+//           10*9 at block 300 ; zeros elsewhere
+// ============================================================================
+void test12() {
+  static i8 back[301 * BLOCKSIZE];
+  i8 buf[20];
+
+  scratchIn();
+  fsFormat(1000, BLOCKSIZE, 8);
+  fsMount();
+  i32 fd   = fsCreate("SPARSE");
+  i32 used = usedBlocks();
+
+  fsSeek(fd, 100 * BLOCKSIZE + 10, SEEK_SET);
+  checkEqual(12, "size after fsSeek", 100 * BLOCKSIZE + 10, fsSize(fd));
+  checkEqual(12, "blocks used by fsSeek", 0, usedBlocks() - used);
+
+  memset(buf, 7, 20);
+  fsWrite(fd, 20, buf);
+  memset(buf, 9, 10);
+  fsPwrite(fd, 10, buf, 300 * BLOCKSIZE);
+  checkEqual(12, "size", 300 * BLOCKSIZE + 10, fsSize(fd));
+  checkEqual(12, "blocks used", 2, usedBlocks() - used);
+  checkEqual(12, "FBN 50 mapped", ENODBN, bfsFbnToDbn(bfsFdToInum(fd), 50));
+
+  memset(back, -1, sizeof(back));
+  i32 size = 300 * BLOCKSIZE + 10;
+  checkEqual(12, "bytes read", size, fsPread(fd, size, back, 0));
+
+  i32 bad = -1;                           // first byte read wrongly
+  for (int i = 0; i < size && bad < 0; ++i) {
+    i32 want = 0;
+    if (i >= 100 * BLOCKSIZE + 10 && i < 100 * BLOCKSIZE + 30) want = 7;
+    if (i >= 300 * BLOCKSIZE)                                  want = 9;
+    if (back[i] != want) bad = i;
+  }
+  checkEqual(12, "first bad byte", -1, bad);
+  fsClose(fd);
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 15 : Cache counters.  On a scratch disk mounted with a 16-block cache,
+//           a free block is written, then read twice: one miss, then hits,
+//           with no read from disk.  Reading 20 other blocks evicts it,
+//           writing it back; read again, it misses and comes back intact
+//           miss, 2 hits, 0 dev reads ; 20 misses, >= 5 evictions, >= 1
+//           writeback ; 1 miss, 1 dev read ; 512*42
+// ============================================================================
+void test15() {
+  i8 buf[BLOCKSIZE];
+  BioStats s0, s1;
+
+  scratchIn();
+  fsFormat(1000, BLOCKSIZE, 8);
+  bioCacheSize(16);
+  fsMount();
+  i32 dbn = bfsBitmapScan(MINDBN, 0);     // a free block, in no file
+
+  bioCacheStats(&s0);
+  memset(buf, 42, BLOCKSIZE);
+  bioWrite(dbn, buf);
+  bioRead(dbn, buf);
+  bioRead(dbn, buf);
+  bioCacheStats(&s1);
+  checkEqual(15, "misses", 1, (i32)(s1.misses - s0.misses));
+  checkEqual(15, "hits", 2, (i32)(s1.hits - s0.hits));
+  checkEqual(15, "dev reads", 0, (i32)(s1.devReads - s0.devReads));
+
+  s0 = s1;
+  for (i32 k = 1; k <= 20; ++k) bioRead(dbn + k, buf);
+  bioCacheStats(&s1);
+  checkEqual(15, "misses", 20, (i32)(s1.misses - s0.misses));
+  checkEqual(15, "evictions >= 5", 1, s1.evictions - s0.evictions >= 5);
+  checkEqual(15, "writebacks >= 1", 1, s1.writebacks - s0.writebacks >= 1);
+
+  s0 = s1;
+  memset(buf, 0, BLOCKSIZE);
+  bioRead(dbn, buf);
+  bioCacheStats(&s1);
+  checkEqual(15, "misses", 1, (i32)(s1.misses - s0.misses));
+  checkEqual(15, "dev reads", 1, (i32)(s1.devReads - s0.devReads));
+  i32 bad = 0;
+  for (i32 i = 0; i < BLOCKSIZE; ++i) bad += buf[i] != 42;
+  checkEqual(15, "bytes changed", 0, bad);
+
+  fsUnmount();
+  bioCacheSize(BIOCACHEBLOCKS);
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 16 : Allocating near a goal.  On a scratch disk, bfsAllocRun takes 10
+//           blocks at a free goal, then the next 10 right after them.  A
+//           goal 5 blocks short of a used block skips the short run there
+//           for the full run past it.  A goal near the end of the disk,
+//           with too little room left, wraps round to the first full run
+//           goal ; goal+10 ; goal+31 ; MINDBN ; 10 blocks each time
+// ============================================================================
+void test16() {
+  scratchIn();
+  fsFormat(1000, BLOCKSIZE, 8);
+  fsMount();
+
+  i32 goal = MINDBN + 100;
+  i32 got  = 0;
+  checkEqual(16, "DBN", goal, bfsAllocRun(goal, 10, &got));
+  checkEqual(16, "got", 10, got);
+  checkEqual(16, "DBN", goal + 10, bfsAllocRun(goal, 10, &got));
+  checkEqual(16, "got", 10, got);
+  checkEqual(16, "first free", goal + 20, bfsBitmapScan(goal, 0));
+
+  bfsBitmapMark(goal + 30, 1, 1);
+  checkEqual(16, "DBN", goal + 31, bfsAllocRun(goal + 25, 10, &got));
+  checkEqual(16, "got", 10, got);
+
+  checkEqual(16, "DBN", MINDBN, bfsAllocRun(BLOCKSPERDISK - 3, 10, &got));
+  checkEqual(16, "got", 10, got);
+
+  fsUnmount();
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 17 : Readahead window.  On a scratch disk with the default cache, a
+//           file of 200 blocks is read a block at a time: the window opens
+//           at RAMINBLOCKS and doubles with each read, up to a quarter of
+//           the cache, and blocks are read ahead.  A seek elsewhere closes
+//           it; reading on from there opens it again
+//           windows 4, 8, 16, 16 ; readaheads > 0 ; 0 after the seek, 4
+// ============================================================================
+void test17() {
+  static i8 data[200 * BLOCKSIZE];
+  i8  buf[BLOCKSIZE];
+  i32 want[4] = {RAMINBLOCKS, 2 * RAMINBLOCKS, BIOCACHEBLOCKS / 4,
+                 BIOCACHEBLOCKS / 4};
+  BioStats s0, s1;
+
+  scratchIn();
+  fsFormat(1000, BLOCKSIZE, 8);
+  fsMount();
+  i32 fd = fsCreate("STREAM");
+  fsWrite(fd, sizeof(data), data);
+  fsClose(fd);
+
+  fd = fsOpen("STREAM");
+  FDTE* fdte = &g_fdt[fd - FIRSTFD];
+  bioCacheStats(&s0);
+  for (i32 k = 0; k < 4; ++k) {
+    fsRead(fd, BLOCKSIZE, buf);
+    checkEqual(17, "window", want[k], fdte->raWin);
+  }
+  bioCacheStats(&s1);
+  checkEqual(17, "read ahead", 1, s1.readAheads > s0.readAheads);
+
+  fsSeek(fd, 150 * BLOCKSIZE, SEEK_SET);
+  fsRead(fd, BLOCKSIZE, buf);
+  checkEqual(17, "window after seek", 0, fdte->raWin);
+  fsRead(fd, BLOCKSIZE, buf);
+  checkEqual(17, "window", RAMINBLOCKS, fdte->raWin);
+
+  fsClose(fd);
+  fsUnmount();
+  scratchOut();
+}
+
+
+
+void bfstest() {
+
+  // Each test formats a scratch disk of its own, and leaves it unmounted
+
+  test10();
+  test11();
+  test12();
+  test15();
+  test16();
+  test17();
+
+}
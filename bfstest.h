@@ -0,0 +1,24 @@
+#ifndef BFSTEST_H
+#define BFSTEST_H
+
+// ============================================================================
+// bfstest.h - tests that look below the fs* API, at the bitmap, Extents,
+// journal and cache.  They share the reporting helpers of p5test.c, but
+// not its header: that one fixes BYTESPERBLOCK, which bfs.h reads from the
+// mounted disk
+// ============================================================================
+
+#include "alias.h"        // i32, etc
+
+void checkEqual(i32 testnum, str what, i32 expected, i32 actual);
+void scratchIn();
+void scratchOut();
+void test10();
+void test11();
+void test12();
+void test15();
+void test16();
+void test17();
+void bfstest();
+
+#endif
@@ -1,48 +1,1298 @@
 // ============================================================================
 // bio.c - low level Block IO functions
+//
+// All block IO goes through a write-back buffer cache.  Buffers are found
+// via a hash on DBN and recycled in least-recently-used order.  A dirty
+// buffer reaches the disk when it is evicted, on bioFlush/bioClose, or when
+// the flusher thread finds it older than BIODIRTYAGEMS or finds more than
+// BIODIRTYPCT percent of the cache dirty.  Write-back goes in DBN order,
+// adjacent blocks gathered into one syscall.
+// A buffer pinned by the journal is never evicted or flushed: its block
+// may not reach its home location until the journal has committed it.
+//
+// The cache is guarded by one mutex.  bioReadRange and bioWriteRange drop
+// it for their syscall, so transfers to different files overlap; callers
+// must not move the same blocks from two threads at once.  No other
+// syscall is made under it either: a buffer being read in, or written
+// back, is marked busy (Buf.io) while the lock is dropped.  A thread that
+// needs its contents, or would change or recycle it, waits for it
+//
+// The disk may be striped over several image files, RAID-0 style: stripe
+// unit s (blocks s * stripe .. s * stripe + stripe - 1) lives in image
+// s % nimg, so each image's share of a run of DBNs is adjacent in that
+// image.  A transfer of many blocks thus costs one syscall per image; each
+// image has a thread of its own to make them, and they run in parallel
 // ============================================================================
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "bfs.h"
 #include "bio.h"
+#include "prf.h"
+
+#define MAXIOV 64                         // most buffers gathered per syscall
+#define SYSIOV 1024                       // most buffers preadv takes: IOV_MAX
+
+#define STRIPEREAD  0                     // Piece ops
+#define STRIPEWRITE 1
+#define STRIPESYNC  2
+
+#define BUFREAD  1                        // Buf.io: being read, not valid yet
+#define BUFWRITE 2                        // Buf.io: being written back
+
+typedef struct Buf {      // one cached disk block
+  i32  dbn;               // DBN held in this buffer.  -1 => buffer unused
+  i32  dirty;             // 1 => modified since read from disk
+  i32  pinned;            // 1 => held back for the journal
+  i32  io;                // BUFREAD/BUFWRITE => syscall, lock dropped
+  i64  dirtied;           // msNow() when it last went from clean to dirty
+  struct Buf* hnext;      // next buffer on the same hash chain
+  struct Buf* prev;       // LRU list: towards most-recently used
+  struct Buf* next;       // LRU list: towards least-recently used
+  i8*  data;              // BYTESPERBLOCK bytes of block contents
+} Buf;
+
+typedef struct Piece {    // one image's share of a striped transfer
+  i32    op;              // STRIPEREAD, STRIPEWRITE or STRIPESYNC
+  i32    img;             // image it goes to
+  off_t  off;             // byte offset in that image
+  struct iovec* iov;      // its buffers, in image order
+  i32    niov;            // # of entries in 'iov'
+  i32    ok;              // 1 => every byte moved
+  i32*   pending;         // # of the transfer's pieces still queued or running
+  struct Piece* next;     // next in the image's queue
+} Piece;
+
+static i32      g_disk  = -1;             // file descriptor of open BFS disk
+static str      g_path  = NULL;           // its path, as given to bioOpen
+static i32      g_nimg  = 1;              // # of images it is striped over
+static i32      g_stripe = 1;             // blocks per stripe unit
+static i32      g_fds[BIOMAXIMAGES];      // [i]: image i.  [0] is 'g_disk'
+
+static pthread_t       g_ioThreads[BIOMAXIMAGES]; // [i]: runs image i's IO
+static Piece*          g_ioHead[BIOMAXIMAGES];    // [i]: image i's queue
+static Piece*          g_ioTail[BIOMAXIMAGES];
+static i32             g_ioUp   = 0;      // 1 => IO threads running
+static i32             g_ioStop = 0;      // 1 => IO threads should exit
+static pthread_mutex_t g_ioLock = PTHREAD_MUTEX_INITIALIZER; // guards queues
+static pthread_cond_t  g_ioWork = PTHREAD_COND_INITIALIZER;  // a piece queued
+static pthread_cond_t  g_ioDone = PTHREAD_COND_INITIALIZER;  // a piece done
+static pthread_once_t  g_ioOnce = PTHREAD_ONCE_INIT;         // see ioAtFork
+
+static i32      g_nbufs = BIOCACHEBLOCKS; // # of buffers in the cache
+static i32      g_nhash = 0;              // # of hash chains (power of 2)
+static Buf*     g_bufs  = NULL;           // array of 'g_nbufs' buffers
+static Buf**    g_hash  = NULL;           // array of 'g_nhash' chain heads
+static i8*      g_data  = NULL;           // block contents for all buffers
+static Buf*     g_mru   = NULL;           // head of LRU list
+static Buf*     g_lru   = NULL;           // tail of LRU list
+static i32      g_npinned = 0;            // # of pinned buffers
+static i32      g_ndirty  = 0;            // # of dirty buffers, pinned or not
+static i32      g_nbusy   = 0;            // # of buffers with 'io' set
+static BioStats g_stats;                  // cache counters
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards cache
+static pthread_cond_t  g_bufDone = PTHREAD_COND_INITIALIZER; // an io ended
+
+static pthread_t      g_flusher;          // background write-back thread
+static i32            g_flusherUp   = 0;  // 1 => 'g_flusher' is running
+static i32            g_flusherStop = 0;  // 1 => 'g_flusher' should exit
+static pthread_cond_t g_flushCond = PTHREAD_COND_INITIALIZER; // wakes it
+
+// ============================================================================
+// Milliseconds since some fixed point, from the monotonic clock
+// ============================================================================
+static i64 msNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+
+// ============================================================================
+// Image holding block 'dbn'
+// ============================================================================
+static i32 imgOf(i32 dbn) { return (dbn / g_stripe) % g_nimg; }
+
+
+
+// ============================================================================
+// Byte offset of block 'dbn' within its image
+// ============================================================================
+static off_t imgOff(i32 dbn) {
+  i64 unit = dbn / g_stripe;
+  return ((unit / g_nimg) * g_stripe + dbn % g_stripe) * (off_t)BYTESPERBLOCK;
+}
+
+
+
+// ============================================================================
+// Make the syscalls for piece 'p', at most SYSIOV buffers each, and note
+// in 'p->ok' whether they moved every byte
+// ============================================================================
+static void pieceRun(Piece* p) {
+  i32 fd = g_fds[p->img];
+  if (p->op == STRIPESYNC) { p->ok = fdatasync(fd) == 0; return; }
+
+  off_t off = p->off;
+  p->ok = 1;
+  for (i32 i = 0; i < p->niov && p->ok; i += SYSIOV) {
+    i32 k = (p->niov - i < SYSIOV) ? p->niov - i : SYSIOV;
+    ssize_t want = 0;
+    for (i32 j = 0; j < k; ++j) want += p->iov[i + j].iov_len;
+    ssize_t numb = (p->op == STRIPEREAD) ? preadv (fd, p->iov + i, k, off)
+                                         : pwritev(fd, p->iov + i, k, off);
+    p->ok = numb == want;
+    off += want;
+  }
+}
+
+
+
+// ============================================================================
+// Body of the IO thread for image 'arg': run the pieces queued for it, in
+// order, until bioClose
+// ============================================================================
+static void* ioThread(void* arg) {
+  i32 img = (i32)(intptr_t)arg;
+  pthread_mutex_lock(&g_ioLock);
+  for (;;) {
+    while (!g_ioStop && g_ioHead[img] == NULL) {
+      pthread_cond_wait(&g_ioWork, &g_ioLock);
+    }
+    Piece* p = g_ioHead[img];
+    if (p == NULL) break;                  // stopping, and nothing queued
+    g_ioHead[img] = p->next;
+    if (g_ioHead[img] == NULL) g_ioTail[img] = NULL;
+
+    pthread_mutex_unlock(&g_ioLock);
+    pieceRun(p);
+    pthread_mutex_lock(&g_ioLock);
+    --*p->pending;
+    pthread_cond_broadcast(&g_ioDone);
+  }
+  pthread_mutex_unlock(&g_ioLock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Run the 'n' pieces at 'pc' in parallel: the first on this thread, the
+// others on their images' IO threads.  Return when all are done.  On
+// failure, abort
+// ============================================================================
+static void piecesRun(Piece* pc, i32 n) {
+  i32 pending = 0;
+  pthread_mutex_lock(&g_ioLock);
+  for (i32 i = 1; g_ioUp && i < n; ++i) {
+    Piece* p   = &pc[i];
+    p->pending = &pending;
+    p->next    = NULL;
+    if (g_ioTail[p->img]) g_ioTail[p->img]->next = p;
+    else                  g_ioHead[p->img] = p;
+    g_ioTail[p->img] = p;
+    ++pending;
+  }
+  if (pending > 0) pthread_cond_broadcast(&g_ioWork);
+  pthread_mutex_unlock(&g_ioLock);
+
+  pieceRun(&pc[0]);
+  for (i32 i = 1; !g_ioUp && i < n; ++i) pieceRun(&pc[i]);  // forked
+
+  pthread_mutex_lock(&g_ioLock);
+  while (pending > 0) pthread_cond_wait(&g_ioDone, &g_ioLock);
+  pthread_mutex_unlock(&g_ioLock);
+
+  for (i32 i = 0; i < n; ++i) {
+    if (pc[i].ok) continue;
+    if (pc[i].op == STRIPEREAD) FATAL(EBADREAD);
+    FATAL(EBADWRITE);
+  }
+}
+
+
+
+// ============================================================================
+// Move 'n' adjacent blocks, starting at 'dbn', to (STRIPEWRITE) or from
+// (STRIPEREAD) the images of a striped disk.  'iov' holds 'niov' buffers,
+// each a whole number of blocks, covering n * BYTESPERBLOCK bytes.  Each
+// image gets one piece, gathering its blocks' buffers
+// ============================================================================
+static void stripeRun(i32 op, i32 dbn, i32 n, struct iovec* iov, i32 niov) {
+  i32 cnt[BIOMAXIMAGES];                  // # of blocks for each image
+  memset(cnt, 0, sizeof(cnt));
+  for (i32 k = 0; k < n; ++k) ++cnt[imgOf(dbn + k)];
+
+  struct iovec few[MAXIOV];
+  struct iovec* vec = (n <= MAXIOV) ? few : malloc(n * sizeof(struct iovec));
+  if (vec == NULL) FATAL(ENOMEM);
+
+  Piece  pc[BIOMAXIMAGES];
+  Piece* of[BIOMAXIMAGES];                // [i]: image i's piece, if any
+  i32 npc = 0;
+  i32 at  = 0;                            // next free entry of 'vec'
+  for (i32 i = 0; i < g_nimg; ++i) {
+    of[i] = NULL;
+    if (cnt[i] == 0) continue;
+    Piece* p = &pc[npc++];
+    p->op   = op;
+    p->img  = i;
+    p->iov  = vec + at;
+    p->niov = 0;
+    at += cnt[i];
+    of[i] = p;
+  }
+
+  // Hand each block's buffer to its image's piece, merging it with the
+  // piece's last buffer when they touch in memory
+
+  i32    v  = 0;                          // entry of 'iov' holding block k
+  size_t in = 0;                          // bytes of iov[v] before block k
+  for (i32 k = 0; k < n; ++k) {
+    if (v >= niov) FATAL(EBIGNUMB);
+    i8* mem = (i8*)iov[v].iov_base + in;
+    in += BYTESPERBLOCK;
+    if (in >= iov[v].iov_len) { ++v; in = 0; }
+
+    Piece* p = of[imgOf(dbn + k)];
+    if (p->niov == 0) p->off = imgOff(dbn + k);
+    struct iovec* last = p->niov ? &p->iov[p->niov - 1] : NULL;
+    if (last && (i8*)last->iov_base + last->iov_len == mem) {
+      last->iov_len += BYTESPERBLOCK;
+    } else {
+      p->iov[p->niov].iov_base = mem;
+      p->iov[p->niov].iov_len  = BYTESPERBLOCK;
+      ++p->niov;
+    }
+  }
+
+  piecesRun(pc, npc);
+  if (vec != few) free(vec);
+}
+
+
+
+
+// ============================================================================
+// Raw read of block 'dbn' from the disk, bypassing the cache
+// ============================================================================
+static void devRead(i32 dbn, void* buf) {
+  if (g_disk < 0) FATAL(ENODISK);
+  i64     t0   = prfBegin(PRFDEVREAD);
+  ssize_t numb = pread(g_fds[imgOf(dbn)], buf, BYTESPERBLOCK, imgOff(dbn));
+  if (numb != BYTESPERBLOCK) FATAL(EBADREAD);
+  __atomic_add_fetch(&g_stats.devReads, 1, __ATOMIC_RELAXED);
+  prfDev(dbn, 1);
+  prfEnd(PRFDEVREAD, t0, BYTESPERBLOCK, 1);
+}
+
+
+
+// ============================================================================
+// Raw write of block 'dbn' to the disk, bypassing the cache
+// ============================================================================
+static void devWrite(i32 dbn, void* buf) {
+  if (g_disk < 0) FATAL(ENODISK);
+  i64     t0   = prfBegin(PRFDEVWRITE);
+  ssize_t numb = pwrite(g_fds[imgOf(dbn)], buf, BYTESPERBLOCK, imgOff(dbn));
+  if (numb != BYTESPERBLOCK) FATAL(EBADWRITE);
+  __atomic_add_fetch(&g_stats.devWrites, 1, __ATOMIC_RELAXED);
+  prfDev(dbn, 1);
+  prfEnd(PRFDEVWRITE, t0, BYTESPERBLOCK, 1);
+}
+
+
+
+// ============================================================================
+// Raw read of 'n' adjacent blocks, starting at 'dbn', with a single syscall
+// (one per image, in parallel, if striped).  'iov' holds 'niov' destination
+// buffers, each a whole number of blocks, covering n * BYTESPERBLOCK bytes
+// ============================================================================
+static void devReadv(i32 dbn, i32 n, struct iovec* iov, i32 niov) {
+  if (g_disk < 0) FATAL(ENODISK);
+  i64     t0   = prfBegin(PRFDEVREAD);
+  ssize_t want = (ssize_t)n * BYTESPERBLOCK;
+  if (g_nimg > 1) {
+    stripeRun(STRIPEREAD, dbn, n, iov, niov);
+  } else {
+    off_t boff = (off_t)dbn * BYTESPERBLOCK;
+    if (preadv(g_disk, iov, niov, boff) != want) FATAL(EBADREAD);
+  }
+  __atomic_add_fetch(&g_stats.devReads, n, __ATOMIC_RELAXED);
+  prfDev(dbn, n);
+  prfEnd(PRFDEVREAD, t0, want, n);
+}
+
+
+
+// ============================================================================
+// Raw write of 'n' adjacent blocks, starting at 'dbn', with a single syscall
+// (one per image, in parallel, if striped).  'iov' holds 'niov' source
+// buffers, each a whole number of blocks, covering n * BYTESPERBLOCK bytes
+// ============================================================================
+static void devWritev(i32 dbn, i32 n, struct iovec* iov, i32 niov) {
+  if (g_disk < 0) FATAL(ENODISK);
+  i64     t0   = prfBegin(PRFDEVWRITE);
+  ssize_t want = (ssize_t)n * BYTESPERBLOCK;
+  if (g_nimg > 1) {
+    stripeRun(STRIPEWRITE, dbn, n, iov, niov);
+  } else {
+    off_t boff = (off_t)dbn * BYTESPERBLOCK;
+    if (pwritev(g_disk, iov, niov, boff) != want) FATAL(EBADWRITE);
+  }
+  __atomic_add_fetch(&g_stats.devWrites, n, __ATOMIC_RELAXED);
+  prfDev(dbn, n);
+  prfEnd(PRFDEVWRITE, t0, want, n);
+}
+
+
+
+// ============================================================================
+// Hash chain for block 'dbn'
+// ============================================================================
+static Buf** hashChain(i32 dbn) { return &g_hash[dbn & (g_nhash - 1)]; }
+
+
+
+// ============================================================================
+// Unlink 'b' from the LRU list
+// ============================================================================
+static void lruUnlink(Buf* b) {
+  if (b->prev) b->prev->next = b->next; else g_mru = b->next;
+  if (b->next) b->next->prev = b->prev; else g_lru = b->prev;
+  b->prev = b->next = NULL;
+}
+
+
+
+// ============================================================================
+// Make 'b' the most-recently used buffer
+// ============================================================================
+static void lruTouch(Buf* b) {
+  if (g_mru == b) return;
+  lruUnlink(b);
+  b->next = g_mru;
+  if (g_mru) g_mru->prev = b;
+  g_mru = b;
+  if (g_lru == NULL) g_lru = b;
+}
+
+
+
+// ============================================================================
+// Remove 'b' from its hash chain
+// ============================================================================
+static void hashRemove(Buf* b) {
+  Buf** pp = hashChain(b->dbn);
+  while (*pp != b) pp = &(*pp)->hnext;
+  *pp = b->hnext;
+  b->hnext = NULL;
+}
+
+
+
+// ============================================================================
+// Before fork: hold the cache and the queues still
+// ============================================================================
+static void ioPrepare() {
+  pthread_mutex_lock(&g_lock);
+  pthread_mutex_lock(&g_ioLock);
+}
+
+
+
+// ============================================================================
+// After fork, in the parent
+// ============================================================================
+static void ioParent() {
+  pthread_mutex_unlock(&g_ioLock);
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+
+// ============================================================================
+// After fork, in the child.  Only the forking thread lives on there: it
+// makes all IO itself, and no flusher thread is left to stop.  A syscall
+// another thread had in progress is the parent's: here a buffer being
+// written back is simply still dirty, and one being read in holds nothing
+// ============================================================================
+static void ioChild() {
+  pthread_mutex_init(&g_ioLock, NULL);
+  pthread_cond_init(&g_ioWork, NULL);
+  pthread_cond_init(&g_ioDone, NULL);
+  g_ioUp = 0;
+
+  pthread_mutex_init(&g_lock, NULL);
+  pthread_cond_init(&g_flushCond, NULL);
+  pthread_cond_init(&g_bufDone, NULL);
+  g_flusherUp = 0;
+  for (i32 i = 0; g_bufs != NULL && i < g_nbufs; ++i) {
+    Buf* b = &g_bufs[i];
+    if (b->io == BUFREAD) { hashRemove(b); b->dbn = -1; }
+    b->io = 0;
+  }
+  g_nbusy = 0;
+}
+
+
+
+// ============================================================================
+// Register the fork handlers, once per process
+// ============================================================================
+static void ioAtFork() { pthread_atfork(ioPrepare, ioParent, ioChild); }
+
+
+
+// ============================================================================
+// Mark 'b' dirty (1) or clean (0), keeping 'g_ndirty' and the time it was
+// dirtied.  Caller holds g_lock
+// ============================================================================
+static void setDirty(Buf* b, i32 dirty) {
+  if (dirty && !b->dirty) { ++g_ndirty; b->dirtied = msNow(); }
+  if (!dirty && b->dirty) --g_ndirty;
+  b->dirty = dirty;
+}
+
+
+
+// ============================================================================
+// Return 1 if more than BIODIRTYPCT percent of the cache is dirty and free
+// to be written back, else 0.  Caller holds g_lock
+// ============================================================================
+static i32 tooDirty() {
+  return (i64)(g_ndirty - g_npinned) * 100 > (i64)BIODIRTYPCT * g_nbufs;
+}
+
+
+
+// ============================================================================
+// Find block 'dbn' in the cache.  Return NULL if not cached
+// ============================================================================
+static Buf* cacheFind(i32 dbn) {
+  if (g_bufs == NULL) return NULL;
+  for (Buf* b = *hashChain(dbn); b != NULL; b = b->hnext) {
+    if (b->dbn == dbn) return b;
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Find block 'dbn' in the cache, first waiting out any syscall on its
+// buffer of a kind in 'quiet' (a set of Buf.io bits).  Return NULL if not
+// cached.  Caller holds g_lock, which the wait drops
+// ============================================================================
+static Buf* cacheWait(i32 dbn, i32 quiet) {
+  Buf* b;
+  while ((b = cacheFind(dbn)) != NULL && (b->io & quiet)) {
+    pthread_cond_wait(&g_bufDone, &g_lock);
+  }
+  return b;
+}
+
+
+
+// ============================================================================
+// Return the buffer holding block 'dbn', as cacheWait, setting '*hit' to 1.
+// If not cached, take the least-recently used buffer that is clean and
+// neither pinned nor busy, rebind it to 'dbn' and set '*hit' to 0: its
+// contents are then undefined.  A dirty buffer met on the way is written
+// back, with g_lock dropped, and the search starts afresh, as it does
+// after waiting because every candidate is busy.  Caller holds g_lock
+// ============================================================================
+static Buf* cacheGet(i32 dbn, i32 quiet, i32* hit) {
+  Buf* b;
+  for (;;) {
+    if ((b = cacheWait(dbn, quiet)) != NULL) { *hit = 1; return b; }
+    b = g_lru;
+    while (b != NULL && (b->pinned || b->io)) b = b->prev;
+    if (b == NULL) {
+      if (g_nbusy == 0) FATAL(EPINNED);
+      pthread_cond_wait(&g_bufDone, &g_lock);
+      continue;
+    }
+    if (!b->dirty) break;
+
+    b->io = BUFWRITE;
+    ++g_nbusy;
+    pthread_mutex_unlock(&g_lock);
+    devWrite(b->dbn, b->data);
+    pthread_mutex_lock(&g_lock);
+    b->io = 0;
+    --g_nbusy;
+    setDirty(b, 0);
+    ++g_stats.writebacks;
+    pthread_cond_broadcast(&g_bufDone);
+  }
+  *hit = 0;
+  if (b->dbn >= 0) {
+    hashRemove(b);
+    ++g_stats.evictions;
+  }
+  setDirty(b, 0);
+  b->dbn   = dbn;
+  b->pinned = 0;
+  Buf** chain = hashChain(dbn);
+  b->hnext = *chain;
+  *chain   = b;
+  return b;
+}
+
+
+
+// ============================================================================
+// Release all memory held by the cache.  Dirty buffers are NOT written
+// ============================================================================
+static void cacheFree() {
+  free(g_bufs); g_bufs = NULL;
+  free(g_hash); g_hash = NULL;
+  free(g_data); g_data = NULL;
+  g_mru = g_lru = NULL;
+  g_nhash = 0;
+  g_npinned = 0;
+  g_ndirty = 0;
+}
+
+
+
+// ============================================================================
+// Allocate an empty cache of 'g_nbufs' buffers, each one block in size.
+// Done on first use, once the mounted disk's block size is known
+// ============================================================================
+static void cacheAlloc() {
+  g_nhash = 1;
+  while (g_nhash < g_nbufs) g_nhash <<= 1;
+
+  g_bufs = calloc(g_nbufs, sizeof(Buf));
+  g_hash = calloc(g_nhash, sizeof(Buf*));
+  g_data = malloc((size_t)g_nbufs * BYTESPERBLOCK);
+  if (!g_bufs || !g_hash || !g_data) FATAL(ENOMEM);
+
+  for (i32 i = 0; i < g_nbufs; ++i) {
+    Buf* b  = &g_bufs[i];
+    b->dbn  = -1;
+    b->data = g_data + (size_t)i * BYTESPERBLOCK;
+    b->prev = (i > 0) ? &g_bufs[i - 1] : NULL;
+    b->next = (i < g_nbufs - 1) ? &g_bufs[i + 1] : NULL;
+  }
+  g_mru = &g_bufs[0];
+  g_lru = &g_bufs[g_nbufs - 1];
+}
+
+
+
+// ============================================================================
+// Order DBNs for qsort
+// ============================================================================
+static int dbnCompare(const void* a, const void* b) {
+  i32 x = *(const i32*)a;
+  i32 y = *(const i32*)b;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Write back every dirty, unpinned buffer holding a DBN in 'lo' .. 'hi'-1
+// that was dirtied at or before time 'cutoff' (msNow() units).  They go in
+// DBN order; each run of adjacent dirty blocks in the range, whatever their
+// age, is gathered into one syscall, made with g_lock dropped.  Returns
+// once every write-back in the range, this call's or another thread's, is
+// done.  Caller holds g_lock
+// ============================================================================
+static void cacheFlush(i32 lo, i32 hi, i64 cutoff) {
+  if (g_bufs == NULL) return;
+
+  i32* list  = malloc((size_t)g_nbufs * sizeof(i32));  // DBNs to write back
+  i32  nlist = 0;
+  if (list == NULL) FATAL(ENOMEM);
+  for (i32 i = 0; i < g_nbufs; ++i) {
+    Buf* b = &g_bufs[i];
+    if (b->dbn < lo || b->dbn >= hi || !b->dirty || b->pinned) continue;
+    if (b->io == 0 && b->dirtied <= cutoff) list[nlist++] = b->dbn;
+  }
+  qsort(list, nlist, sizeof(i32), dbnCompare);
+
+  Buf* run[MAXIOV];                      // dirty buffers with adjacent DBNs
+  struct iovec iov[MAXIOV];
+
+  for (i32 i = 0; i < nlist; ++i) {
+    Buf* b = cacheFind(list[i]);         // may have changed meanwhile
+    if (b == NULL || !b->dirty || b->pinned || b->io) continue;
+
+    // Walk back to the start of the run of dirty blocks holding 'b', then
+    // gather the run forwards, mark it busy, and write it with one syscall
+
+    i32 dbn = b->dbn;
+    Buf* p;
+    while (dbn > lo && (p = cacheFind(dbn - 1)) != NULL &&
+           p->dirty && !p->pinned && !p->io) --dbn;
+
+    i32 n = 0;
+    while (n < MAXIOV && dbn + n < hi && dbn + n < BLOCKSPERDISK &&
+           (p = cacheFind(dbn + n)) != NULL && p->dirty && !p->pinned &&
+           !p->io) {
+      run[n] = p;
+      p->io  = BUFWRITE;
+      iov[n].iov_base = p->data;
+      iov[n].iov_len  = BYTESPERBLOCK;
+      ++n;
+    }
+    g_nbusy += n;
+    pthread_mutex_unlock(&g_lock);
+    devWritev(dbn, n, iov, n);
+    pthread_mutex_lock(&g_lock);
+
+    for (i32 k = 0; k < n; ++k) { run[k]->io = 0; setDirty(run[k], 0); }
+    g_nbusy -= n;
+    g_stats.writebacks += n;
+    pthread_cond_broadcast(&g_bufDone);
+  }
+  free(list);
+
+  for (i32 i = 0; i < g_nbufs; ++i) {    // wait out other threads' writes
+    Buf* b = &g_bufs[i];
+    if (b->io != BUFWRITE || b->dbn < lo || b->dbn >= hi) continue;
+    pthread_cond_wait(&g_bufDone, &g_lock);
+    i = -1;
+  }
+}
+
+
+
+// ============================================================================
+// Body of the flusher thread.  Every BIOFLUSHMS, or sooner when woken
+// because the cache is too dirty, write back the buffers dirty for longer
+// than BIODIRTYAGEMS, or every buffer if the cache is still too dirty.
+// Runs until bioClose
+// ============================================================================
+static void* flusher(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&g_lock);
+  while (!g_flusherStop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)BIOFLUSHMS * 1000000;
+    ts.tv_sec  += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&g_flushCond, &g_lock, &ts);
+    if (g_flusherStop) break;
+
+    i64 cutoff = tooDirty() ? INT64_MAX : msNow() - BIODIRTYAGEMS;
+    cacheFlush(0, BLOCKSPERDISK, cutoff);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Stop the flusher thread, if running.  Caller does not hold g_lock
+// ============================================================================
+static void flusherStop() {
+  if (!g_flusherUp) return;
+  pthread_mutex_lock(&g_lock);
+  g_flusherStop = 1;
+  pthread_cond_signal(&g_flushCond);
+  pthread_mutex_unlock(&g_lock);
+  pthread_join(g_flusher, NULL);
+  g_flusherUp = 0;
+}
+
+
+
+// ============================================================================
+// Copy 'buf' into the cached copy of block 'dbn', marked dirty, and return
+// its buffer.  Caller holds g_lock
+// ============================================================================
+static Buf* cacheWrite(i32 dbn, void* buf) {
+  if (g_bufs == NULL) cacheAlloc();
+
+  i32 hit;
+  Buf* b = cacheGet(dbn, BUFREAD | BUFWRITE, &hit);
+  if (hit) {
+    ++g_stats.hits;
+    prfCache(1, 0);
+  } else {
+    ++g_stats.misses;
+    prfCache(0, 1);
+  }
+  lruTouch(b);
+
+  memcpy(b->data, buf, BYTESPERBLOCK);
+  setDirty(b, 1);
+  if (tooDirty()) pthread_cond_signal(&g_flushCond);
+  return b;
+}
+
+
+
+// ============================================================================
+// Return the number of buffers in the block cache
+// ============================================================================
+i32 bioCacheBlocks() { return g_nbufs; }
+
+
+
+// ============================================================================
+// Set the number of buffers in the block cache to 'nbufs'.  Any current
+// cache is flushed and dropped; the new one is built on next use.  Not
+// allowed while the journal has buffers pinned.  On success, return 0
+// ============================================================================
+i32 bioCacheSize(i32 nbufs) {
+  if (nbufs < 1)     FATAL(EBIGNUMB);
+  pthread_mutex_lock(&g_lock);
+  if (g_npinned > 0) FATAL(EPINNED);
+  if (g_bufs != NULL) { cacheFlush(0, BLOCKSPERDISK, INT64_MAX); cacheFree(); }
+  g_nbufs = nbufs;
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the block cache counters into 'stats'
+// ============================================================================
+i32 bioCacheStats(BioStats* stats) {
+  if (stats == NULL) FATAL(ENULLPTR);
+  pthread_mutex_lock(&g_lock);
+  *stats = g_stats;
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Close the BFS disk opened by bioOpen, first writing back every dirty
+// buffer.  Safe to call if nothing is open
+// ============================================================================
+i32 bioClose() {
+  flusherStop();
+  pthread_mutex_lock(&g_lock);
+  if (g_disk >= 0) {
+    cacheFlush(0, BLOCKSPERDISK, INT64_MAX);
+    cacheFree();
+  }
+  pthread_mutex_unlock(&g_lock);
+  if (g_disk < 0) return 0;
+
+  if (g_ioUp) {                           // every queue is empty by now
+    pthread_mutex_lock(&g_ioLock);
+    g_ioStop = 1;
+    pthread_cond_broadcast(&g_ioWork);
+    pthread_mutex_unlock(&g_ioLock);
+    for (i32 i = 0; i < g_nimg; ++i) pthread_join(g_ioThreads[i], NULL);
+    g_ioUp = 0;
+  }
+  for (i32 i = 0; i < g_nimg; ++i) {
+    if (close(g_fds[i]) != 0) FATAL(ENODISK);
+  }
+  g_disk   = -1;
+  g_nimg   = 1;
+  g_stripe = 1;
+  free(g_path);
+  g_path = NULL;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Create the BFS disk file 'path', or empty it if it exists, and open it as
+// bioOpen does.  Called by fsFormat.  On success, return 0.  On failure,
+// abort
+// ============================================================================
+i32 bioCreate(str path) {
+  if (path == NULL) FATAL(ENULLPTR);
+  bioClose();
+  i32 fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) FATAL(EDISKCREATE);
+  close(fd);
+  return bioOpen(path);
+}
+
+
+
+// ============================================================================
+// Forget any cached copies of DBNs 'dbn' .. 'dbn' + 'n' - 1, dirty or not,
+// without writing them: their blocks have been freed.  The buffers go to
+// the LRU end, to be recycled first.  Pinned buffers are left alone.  On
+// success, return 0
+// ============================================================================
+i32 bioDiscard(i32 dbn, i32 n) {
+  if (n <= 0)                     FATAL(ENEGNUMB);
+  if (dbn < 0)                    FATAL(EBADDBN);
+  if (dbn + n > BLOCKSPERDISK)    FATAL(EBADDBN);
+
+  pthread_mutex_lock(&g_lock);
+  i32 scan = n > g_nbufs;                // cheaper to look at every buffer
+  for (i32 i = 0; g_bufs != NULL && i < (scan ? g_nbufs : n); ++i) {
+    Buf* b = scan ? &g_bufs[i] : cacheWait(dbn + i, BUFREAD | BUFWRITE);
+    if (b == NULL || b->pinned)               continue;
+    if (b->dbn < dbn || b->dbn >= dbn + n)    continue;
+    if (b->io) {                              // look again once it is done
+      pthread_cond_wait(&g_bufDone, &g_lock);
+      --i;
+      continue;
+    }
+    hashRemove(b);
+    setDirty(b, 0);
+    b->dbn = -1;
+    lruUnlink(b);
+    b->prev = g_lru;
+    if (g_lru) g_lru->next = b; else g_mru = b;
+    g_lru = b;
+  }
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make each image of the disk long enough to hold its share of 'nblocks'
+// blocks, so that blocks never written read as zeros.  On success, return
+// 0.  On failure, abort
+// ============================================================================
+i32 bioExtend(i32 nblocks) {
+  if (nblocks < 0) FATAL(ENEGNUMB);
+  if (g_disk < 0)  FATAL(ENODISK);
+
+  i64 row  = (i64)g_stripe * g_nimg;      // blocks in one stripe per image
+  for (i32 i = 0; i < g_nimg; ++i) {
+    i64 part = nblocks % row - (i64)i * g_stripe;   // in the last row
+    if (part < 0)        part = 0;
+    if (part > g_stripe) part = g_stripe;
+    off_t size = ((nblocks / row) * g_stripe + part) * (off_t)BYTESPERBLOCK;
+
+    struct stat st;
+    if (fstat(g_fds[i], &st) != 0) FATAL(ENODISK);
+    if (st.st_size < size && ftruncate(g_fds[i], size) != 0) FATAL(EBADWRITE);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write every dirty, unpinned buffer in the cache back to the disk.  Buffers
+// stay cached, now clean
+// ============================================================================
+i32 bioFlush() {
+  i64 t0 = prfBegin(PRFBIOFLUSH);
+  pthread_mutex_lock(&g_lock);
+  cacheFlush(0, BLOCKSPERDISK, INT64_MAX);
+  pthread_mutex_unlock(&g_lock);
+  prfEnd(PRFBIOFLUSH, t0, 0, 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write back the dirty, unpinned cached blocks among DBNs 'dbn' .. 'dbn' +
+// 'n' - 1, in DBN order.  On success, return 0
+// ============================================================================
+i32 bioFlushRange(i32 dbn, i32 n) {
+  if (n <= 0)                     FATAL(ENEGNUMB);
+  if (dbn < 0)                    FATAL(EBADDBN);
+  if (dbn + n > BLOCKSPERDISK)    FATAL(EBADDBN);
+
+  i64 t0 = prfBegin(PRFBIOFLUSH);
+
+  pthread_mutex_lock(&g_lock);
+  cacheFlush(dbn, dbn + n, INT64_MAX);
+  pthread_mutex_unlock(&g_lock);
+  prfEnd(PRFBIOFLUSH, t0, 0, 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Open the BFS disk file 'path' and keep its descriptor for all subsequent
+// block IO.  Any disk already open is closed first.  The block cache starts
+// out empty.  The disk is one image until bioStripe says otherwise.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 bioOpen(str path) {
+  if (path == NULL) FATAL(ENULLPTR);
+  bioClose();
+  g_disk = open(path, O_RDWR);
+  if (g_disk < 0) FATAL(ENODISK);
+  g_fds[0] = g_disk;
+  g_path   = strdup(path);
+  if (g_path == NULL) FATAL(ENOMEM);
+
+  pthread_once(&g_ioOnce, ioAtFork);
+  g_flusherStop = 0;
+  if (pthread_create(&g_flusher, NULL, flusher, NULL) != 0) FATAL(ENOMEM);
+  g_flusherUp = 1;
+  return 0;
+}
+
+
 
 // ============================================================================
-// Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'
+// Write one block from 'buf' into block number 'dbn', as bioWrite, and pin
+// it, so it stays in the cache and is not written to its home location
+// until bioUnpin.  Return the number of buffers now pinned
+// ============================================================================
+i32 bioPin(i32 dbn, void* buf) {
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (g_disk < 0)           FATAL(ENODISK);
+
+  pthread_mutex_lock(&g_lock);
+  Buf* b = cacheWrite(dbn, buf);
+  if (!b->pinned) { b->pinned = 1; ++g_npinned; }
+  i32 npinned = g_npinned;
+  pthread_mutex_unlock(&g_lock);
+  return npinned;
+}
+
+
+
+// ============================================================================
+// Read block number 'dbn' in the BFS disk into buffer 'buf'
 // ============================================================================
 i32 bioRead(i32 dbn, void* buf) {
-  if (dbn < 0)             FATAL(EBADDBN);
-  if (dbn > BLOCKSPERDISK) FATAL(EBADDBN);
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (g_disk < 0)           FATAL(ENODISK);
+
+  i64 t0 = prfBegin(PRFBIOREAD);
+
+  pthread_mutex_lock(&g_lock);
+  if (g_bufs == NULL) cacheAlloc();
+
+  i32 hit;
+  Buf* b = cacheGet(dbn, BUFREAD, &hit);
+  lruTouch(b);
+  if (hit) {
+    ++g_stats.hits;
+    prfCache(1, 0);
+  } else {                                // read it in with g_lock dropped
+    ++g_stats.misses;
+    prfCache(0, 1);
+    b->io = BUFREAD;
+    ++g_nbusy;
+    pthread_mutex_unlock(&g_lock);
+    devRead(dbn, b->data);
+    pthread_mutex_lock(&g_lock);
+    b->io = 0;
+    --g_nbusy;
+    pthread_cond_broadcast(&g_bufDone);
+  }
+
+  memcpy(buf, b->data, BYTESPERBLOCK);
+  pthread_mutex_unlock(&g_lock);
+  prfEnd(PRFBIOREAD, t0, BYTESPERBLOCK, 1);
+  return 0;
+}
+
+
+// ============================================================================
+// Bring blocks 'dbn' .. 'dbn' + 'n' - 1 into the cache ahead of use, reading
+// the span not already cached with one syscall.  Reads at most a quarter
+// of the cache.  The caller must keep the blocks from being written
+// meanwhile.  On success, return 0
+// ============================================================================
+i32 bioReadAhead(i32 dbn, i32 n) {
+  if (n <= 0)                     FATAL(ENEGNUMB);
+  if (dbn < 0)                    FATAL(EBADDBN);
+  if (dbn + n > BLOCKSPERDISK)    FATAL(EBADDBN);
+  if (g_disk < 0)                 FATAL(ENODISK);
+
+  i64 t0 = prfBegin(PRFBIOREADAHEAD);
+
+  pthread_mutex_lock(&g_lock);
+  if (g_bufs == NULL) cacheAlloc();
+  if (n > g_nbufs / 4) n = g_nbufs / 4;
+  i32 lo = 0;                             // first uncached block
+  while (lo < n && cacheFind(dbn + lo) != NULL) ++lo;
+  i32 hi = n - 1;                         // last uncached block
+  while (hi > lo && cacheFind(dbn + hi) != NULL) --hi;
+  if (lo >= n) {                          // all cached
+    pthread_mutex_unlock(&g_lock);
+    prfEnd(PRFBIOREADAHEAD, t0, 0, 0);
+    return 0;
+  }
+
+  // Note which blocks in the span are cached: their copy on disk may be
+  // older than the cached one, so what is read for them is never used
+
+  i32 span = hi - lo + 1;
+  i8* tmp = malloc((size_t)span * (BYTESPERBLOCK + 1));
+  if (tmp == NULL) FATAL(ENOMEM);
+  u8* was = (u8*)tmp + (size_t)span * BYTESPERBLOCK;
+  for (i32 i = 0; i < span; ++i) was[i] = cacheFind(dbn + lo + i) != NULL;
+  pthread_mutex_unlock(&g_lock);
+
+  struct iovec iov = { tmp, (size_t)span * BYTESPERBLOCK };
+  devReadv(dbn + lo, span, &iov, 1);
+
+  // A block cached meanwhile is at least as new as the one just read
+
+  pthread_mutex_lock(&g_lock);
+  for (i32 i = 0; i < span; ++i) {
+    if (was[i] || cacheFind(dbn + lo + i) != NULL) continue;
+    i32 hit;
+    Buf* b = cacheGet(dbn + lo + i, 0, &hit);
+    if (hit) continue;
+    memcpy(b->data, tmp + (size_t)i * BYTESPERBLOCK, BYTESPERBLOCK);
+    lruTouch(b);
+    ++g_stats.readAheads;
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  free(tmp);
+  prfEnd(PRFBIOREADAHEAD, t0, (i64)span * BYTESPERBLOCK, span);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read 'numb' bytes at byte offset 'off' of the BFS disk into 'buf', bypassing
+// the cache.  Used to read the Super block before the block size is known.
+// Reads the first image: it starts with the Super block, however striped
+// ============================================================================
+i32 bioReadRaw(i64 off, i32 numb, void* buf) {
+  if (g_disk < 0)  FATAL(ENODISK);
+  if (buf == NULL) FATAL(ENULLPTR);
+  if (pread(g_disk, buf, numb, off) != numb) FATAL(EBADREAD);
+  return 0;
+}
+
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+// ============================================================================
+// Read 'n' adjacent blocks, starting at 'dbn', into 'buf'.  The span from
+// the first to the last uncached block is read from disk with one syscall,
+// straight into 'buf'.  Blocks that are cached (perhaps dirty) are then
+// copied over from the cache
+// ============================================================================
+i32 bioReadRange(i32 dbn, i32 n, void* buf) {
+  if (n <= 0)                     FATAL(ENEGNUMB);
+  if (dbn < 0)                    FATAL(EBADDBN);
+  if (dbn + n > BLOCKSPERDISK)    FATAL(EBADDBN);
+  if (buf == NULL)                FATAL(ENULLPTR);
+  if (g_disk < 0)                 FATAL(ENODISK);
+
+  i64 t0 = prfBegin(PRFBIOREADRANGE);
+
+  i8* dst = (i8*)buf;
+  u8  few[64];
+  u8* was = (n <= 64) ? few : malloc(n);  // 1 => block was cached
+  if (was == NULL) FATAL(ENOMEM);
+
+  pthread_mutex_lock(&g_lock);
+  i32 lo = 0;                             // first uncached block
+  while (lo < n && cacheFind(dbn + lo) != NULL) ++lo;
+  i32 hi = n - 1;                         // last uncached block
+  while (hi > lo && cacheFind(dbn + hi) != NULL) --hi;
+  for (i32 i = 0; i < n; ++i) {
+    was[i] = (i < lo || i > hi) ? 1 : cacheFind(dbn + i) != NULL;
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  if (lo < n) {
+    struct iovec iov = { dst + (size_t)lo * BYTESPERBLOCK,
+                         (size_t)(hi - lo + 1) * BYTESPERBLOCK };
+    devReadv(dbn + lo, hi - lo + 1, &iov, 1);
+  }
+
+  // A cached block may have been evicted meanwhile.  It is on disk by now,
+  // but maybe only since the span was read, so read it on its own, once
+  // g_lock is dropped
+
+  i32 hits = 0;
+  pthread_mutex_lock(&g_lock);
+  for (i32 i = 0; i < n; ++i) {
+    i8* d = dst + (size_t)i * BYTESPERBLOCK;
+    Buf* b = cacheWait(dbn + i, BUFREAD);
+    if (b != NULL) {
+      memcpy(d, b->data, BYTESPERBLOCK);
+      was[i] = 0;
+      ++g_stats.hits;
+      ++hits;
+    } else {
+      ++g_stats.misses;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+  for (i32 i = 0; i < n; ++i) {
+    if (was[i]) devRead(dbn + i, dst + (size_t)i * BYTESPERBLOCK);
+  }
+  prfCache(hits, n - hits);
+
+  if (was != few) free(was);
+  prfEnd(PRFBIOREADRANGE, t0, (i64)n * BYTESPERBLOCK, n);
+  return 0;
+}
+
 
-  i32 numb = fread(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADREAD); }
 
-  fclose(fp);
+// ============================================================================
+// Spread the open disk over 'nimages' image files, 'stripeBlocks' blocks at
+// a time: the file given to bioOpen, then that path with ".1", ".2" ..
+// appended.  Each may be a link to a file on a device of its own.  With
+// 'create' set, the extra images are created, or emptied if they exist.
+// Called before any block IO, by fsFormat and on mount.  On success,
+// return 0.  On failure, abort
+// ============================================================================
+i32 bioStripe(i32 nimages, i32 stripeBlocks, i32 create) {
+  if (g_disk < 0)                                FATAL(ENODISK);
+  if (nimages < 1 || nimages > BIOMAXIMAGES)     FATAL(EBADGEOM);
+  if (stripeBlocks < 1 || g_nimg > 1)            FATAL(EBADGEOM);
+
+  for (i32 i = 1; i < nimages; ++i) {
+    char name[strlen(g_path) + 8];
+    sprintf(name, "%s.%d", g_path, i);
+    g_fds[i] = open(name, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (g_fds[i] < 0) FATAL(ENODISK);
+  }
+
+  if (nimages > 1) {
+    g_ioStop = 0;
+    for (i32 i = 0; i < nimages; ++i) {
+      g_ioHead[i] = g_ioTail[i] = NULL;
+      if (pthread_create(&g_ioThreads[i], NULL, ioThread, (void*)(intptr_t)i)
+          != 0) FATAL(ENOMEM);
+    }
+    g_ioUp = 1;
+  }
+  g_nimg   = nimages;
+  g_stripe = stripeBlocks;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Wait until every write issued so far has reached stable storage.  The
+// images of a striped disk are synced in parallel
+// ============================================================================
+i32 bioSync() {
+  if (g_disk < 0) FATAL(ENODISK);
+  i64 t0 = prfBegin(PRFBIOSYNC);
+  if (g_nimg > 1) {
+    Piece pc[BIOMAXIMAGES];
+    for (i32 i = 0; i < g_nimg; ++i) { pc[i].op = STRIPESYNC; pc[i].img = i; }
+    piecesRun(pc, g_nimg);
+  } else if (fdatasync(g_disk) != 0) {
+    FATAL(EBADWRITE);
+  }
+  prfEnd(PRFBIOSYNC, t0, 0, 0);
   return 0;
 }
 
 
+
 // ============================================================================
-// Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk
+// Release the pin bioPin put on block 'dbn'.  A dirty block may now be
+// written back as usual
+// ============================================================================
+i32 bioUnpin(i32 dbn) {
+  pthread_mutex_lock(&g_lock);
+  Buf* b = cacheFind(dbn);
+  if (b == NULL || !b->pinned) FATAL(EBADDBN);
+  b->pinned = 0;
+  --g_npinned;
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write one block from 'buf' into block number 'dbn' of the BFS disk.  The
+// block lands in the cache, marked dirty; it reaches the disk on eviction
+// or on the next bioFlush
 // ============================================================================
 i32 bioWrite(i32 dbn, void* buf) {
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (g_disk < 0)           FATAL(ENODISK);
+
+  i64 t0 = prfBegin(PRFBIOWRITE);
+
+  pthread_mutex_lock(&g_lock);
+  cacheWrite(dbn, buf);
+  pthread_mutex_unlock(&g_lock);
+  prfEnd(PRFBIOWRITE, t0, BYTESPERBLOCK, 1);
+  return 0;
+}
+
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+// ============================================================================
+// Write one block from 'buf' straight to block 'dbn' on the disk.  A pinned
+// cached copy is left alone: it is newer, and not yet committed.  Any other
+// cached copy takes the new contents and becomes clean.  Used by the
+// journal to put a committed block home while it is pinned again
+// ============================================================================
+i32 bioWriteHome(i32 dbn, void* buf) {
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+  if (g_disk < 0)           FATAL(ENODISK);
+
+  pthread_mutex_lock(&g_lock);
+  Buf* b = cacheWait(dbn, BUFREAD | BUFWRITE);
+  if (b != NULL && !b->pinned) {
+    memcpy(b->data, buf, BYTESPERBLOCK);
+    setDirty(b, 0);
+  }
+  pthread_mutex_unlock(&g_lock);
+  devWrite(dbn, buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write 'n' adjacent blocks from 'buf', starting at block 'dbn', to the disk
+// with one syscall.  Any of those blocks already cached take the new
+// contents and become clean, so the cache never holds a stale copy
+// ============================================================================
+i32 bioWriteRange(i32 dbn, i32 n, void* buf) {
+  if (n <= 0)                     FATAL(ENEGNUMB);
+  if (dbn < 0)                    FATAL(EBADDBN);
+  if (dbn + n > BLOCKSPERDISK)    FATAL(EBADDBN);
+  if (buf == NULL)                FATAL(ENULLPTR);
+  if (g_disk < 0)                 FATAL(ENODISK);
+
+  i64 t0 = prfBegin(PRFBIOWRITERANGE);
 
-  i32 numb = fwrite(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADWRITE); }
+  // Bring any cached copy up to date, and clean, before the write: then no
+  // older dirty copy can be written back over it.  The caller keeps the
+  // blocks from being read until this returns
 
-  fclose(fp);
+  i8* src = (i8*)buf;
+  pthread_mutex_lock(&g_lock);
+  for (i32 i = 0; i < n; ++i) {
+    Buf* b = cacheWait(dbn + i, BUFREAD | BUFWRITE);
+    if (b == NULL) continue;
+    memcpy(b->data, src + (size_t)i * BYTESPERBLOCK, BYTESPERBLOCK);
+    setDirty(b, 0);
+  }
+  pthread_mutex_unlock(&g_lock);
 
+  struct iovec iov = { buf, (size_t)n * BYTESPERBLOCK };
+  devWritev(dbn, n, &iov, 1);
+  prfEnd(PRFBIOWRITERANGE, t0, (i64)n * BYTESPERBLOCK, n);
   return 0;
 }
@@ -3,14 +3,49 @@
 
 // ===================================================================
 // bio.h - Block IO interface.  Simulates kernel-mode read and write
-// functions to the BFS disk
+// functions to the BFS disk, through a write-back buffer cache
 // ===================================================================
 
 #include <stdio.h>
 
 #include "alias.h"
 
+#define BIOCACHEBLOCKS 64         // default # of blocks in the buffer cache
+#define BIODIRTYPCT    50         // flush all once this % of cache is dirty
+#define BIODIRTYAGEMS  1000       // flush blocks dirty for longer than this
+#define BIOFLUSHMS     200        // how often the flusher thread looks
+#define BIOMAXIMAGES   16         // most image files a disk is striped over
+
+typedef struct {          // Buffer cache counters
+  u64 hits;               // bioRead/bioWrite found block in cache
+  u64 misses;             // bioRead/bioWrite had to claim a buffer
+  u64 evictions;          // buffers recycled for a different block
+  u64 writebacks;         // dirty buffers written to disk
+  u64 devReads;           // blocks read from disk
+  u64 devWrites;          // blocks written to disk
+  u64 readAheads;         // blocks brought in by bioReadAhead
+} BioStats;
+
+i32 bioCacheBlocks();
+i32 bioCacheSize (i32 nbufs);
+i32 bioCacheStats(BioStats* stats);
+i32 bioClose();
+i32 bioCreate(str path);
+i32 bioDiscard(i32 dbn, i32 n);
+i32 bioExtend (i32 nblocks);
+i32 bioFlush();
+i32 bioFlushRange(i32 dbn, i32 n);
+i32 bioOpen (str path);
+i32 bioPin  (i32 dbn, void* buf);
 i32 bioRead (i32 dbn, void* buf);
+i32 bioReadAhead (i32 dbn, i32 n);
+i32 bioReadRange (i32 dbn, i32 n, void* buf);
+i32 bioReadRaw   (i64 off, i32 numb, void* buf);
+i32 bioStripe(i32 nimages, i32 stripeBlocks, i32 create);
+i32 bioSync();
+i32 bioUnpin(i32 dbn);
 i32 bioWrite(i32 dbn, void* buf);
+i32 bioWriteHome (i32 dbn, void* buf);
+i32 bioWriteRange(i32 dbn, i32 n, void* buf);
 
-#endif
\ No newline at end of file
+#endif
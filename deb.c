@@ -4,12 +4,13 @@
 
 #include "bfs.h"
 #include "deb.h"
+#include "prf.h"
 
 // ============================================================================
 // Dump block DBN
 // ============================================================================
 i32 debDumpDbn(i32 dbn, i32 size) {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[BYTESPERBLOCK];
 
   i8*  buf8  = (i8*) buf;
   i16* buf16 = (i16*)buf;
@@ -53,13 +54,17 @@ i32 debDumpDbn(i32 dbn, i32 size) {
 // Dump the Dir
 // ============================================================================
 i32 debDumpDir() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNDIR, buf);
-  Dir* dir = (Dir*)buf;
+  i8 buf[BYTESPERBLOCK];
+  DirEnt* ents = (DirEnt*)buf;
 
   printf("\n");
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    printf("[%02d]  %s \n", inum, dir->fname[inum]);
+  for (i32 dbn = DBNDIR; dbn < DBNDIR + NUMDIRBLOCKS; ++dbn) {
+    bioRead(dbn, ents);
+    for (i32 slot = 0; slot < DIRPERBLOCK; ++slot) {
+      if (ents[slot].fname[0] == 0) continue;
+      printf("[%02d]  %s  (dbn %d, slot %d) \n",
+        ents[slot].inum, ents[slot].fname, dbn, slot);
+    }
   }
   printf("\n"); fflush(stdout);
 
@@ -72,19 +77,20 @@ i32 debDumpDir() {
 // Dump the Inodes
 // ============================================================================
 i32 debDumpInodes() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNINODES, buf);
-
-  Inode* inodes = (Inode*) buf;
-
   printf("\n");
   for (int inum = 0; inum < NUMINODES; ++inum) {
-    Inode inode = inodes[inum];
+    Inode inode;
+    bfsReadInode(inum, &inode);
     printf("[%d] size = %d \n", inum, inode.size);
-    for (i32 d = 0; d < NUMDIRECT; ++d) {
-      printf("    [%d] direct[%d] = %d \n", inum, d, inode.direct[d]);
+    for (i32 e = 0; e < inode.numExtents; ++e) {
+      Extent ext;
+      bfsExtGet(&inode, e, &ext);
+      printf("    [%d] extent[%d] = fbn %d, dbn %d, len %d \n",
+        inum, e, ext.fbn, ext.dbn, ext.len);
     }
     printf("        indirect  = %d \n", inode.indirect);
+    printf("        dindirect = %d \n", inode.dindirect);
+    printf("        tindirect = %d \n", inode.tindirect);
   }
   printf("\n"); fflush(stdout);
 
@@ -92,20 +98,101 @@ i32 debDumpInodes() {
 }
 
 
+// ============================================================================
+// Format 'ns' nanoseconds into 'out' (room for 16 chars) in a unit to suit
+// ============================================================================
+static void debFmtNs(u64 ns, char* out) {
+  if      (ns < 1000)       sprintf(out, "%luns", ns);
+  else if (ns < 1000000)    sprintf(out, "%.1fus", ns / 1e3);
+  else if (ns < 1000000000) sprintf(out, "%.1fms", ns / 1e6);
+  else                      sprintf(out, "%.1fs",  ns / 1e9);
+}
+
+
+
+// ============================================================================
+// Dump the buffer cache counters, then the performance counters of every
+// operation called so far, each with its latency histogram.  For a machine
+// readable copy, see prfExport
+// ============================================================================
+i32 debDumpStats() {
+  BioStats bs;
+  bioCacheStats(&bs);
+
+  printf("\n");
+  printf("Cache: hits %lu, misses %lu, evictions %lu, writebacks %lu \n",
+    bs.hits, bs.misses, bs.evictions, bs.writebacks);
+  printf("       devReads %lu, devWrites %lu, readAheads %lu \n",
+    bs.devReads, bs.devWrites, bs.readAheads);
+
+  printf("\n%-15s %8s %9s %9s %9s %8s %9s %9s %9s %9s %12s \n",
+    "operation", "calls", "avg", "p50", "p99", "bio/call",
+    "hits", "misses", "metaIO", "dataIO", "bytes");
+
+  char avg[16], p50[16], p99[16];
+  for (i32 op = 0; op < PRFNUMOPS; ++op) {
+    PrfStats s;
+    prfGet(op, &s);
+    if (s.calls == 0) continue;
+    u64 timed = 0;                        // calls counted with PRFTIME
+    for (i32 b = 0; b < PRFBUCKETS; ++b) timed += s.hist[b];
+    debFmtNs(timed ? s.ns / timed : 0, avg);
+    debFmtNs(prfPercentile(&s, 50), p50);
+    debFmtNs(prfPercentile(&s, 99), p99);
+    printf("%-15s %8lu %9s %9s %9s %8.1f %9lu %9lu %9lu %9lu %12lu \n",
+      prfName(op), s.calls, avg, p50, p99, (double)s.bioCalls / s.calls,
+      s.hits, s.misses, s.metaIO, s.dataIO, s.bytes);
+  }
+
+  // Latency histograms: calls per bucket, labelled by the bucket's top
+
+  printf("\n");
+  for (i32 op = 0; op < PRFNUMOPS; ++op) {
+    PrfStats s;
+    prfGet(op, &s);
+    if (s.calls == 0) continue;
+    printf("%-15s", prfName(op));
+    for (i32 b = 0; b < PRFBUCKETS; ++b) {
+      if (s.hist[b] == 0) continue;
+      char top[16];
+      debFmtNs(1ULL << b, top);
+      printf(" <%s:%lu", top, s.hist[b]);
+    }
+    printf(" \n");
+  }
+  printf("\n"); fflush(stdout);
+
+  return 0;
+}
+
+
+
 // ============================================================================
 // Dump the Superblock
 // ============================================================================
 i32 debDumpSuper() {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[BYTESPERBLOCK];
 
   bioRead(DBNSUPER, buf);
 
   Super* super = (Super*)buf;
 
   printf("\n");
-  printf("Super.numBlocks = %d \n", super->numBlocks);
-  printf("Super.numInodes = %d \n", super->numInodes);
-  printf("Super.firstFree = %d \n", super->firstFree);
+  printf("Super.magic           = %08x \n", super->magic);
+  printf("Super.blockSize       = %d \n", super->blockSize);
+  printf("Super.numBlocks       = %d \n", super->numBlocks);
+  printf("Super.numInodes       = %d \n", super->numInodes);
+  printf("Super.dbnInodes       = %d \n", super->dbnInodes);
+  printf("Super.numInodeBlocks  = %d \n", super->numInodeBlocks);
+  printf("Super.dbnBitmap       = %d \n", super->dbnBitmap);
+  printf("Super.numBitmapBlocks = %d \n", super->numBitmapBlocks);
+  printf("Super.dbnDir          = %d \n", super->dbnDir);
+  printf("Super.numDirBlocks    = %d \n", super->numDirBlocks);
+  printf("Super.dbnJnl          = %d \n", super->dbnJnl);
+  printf("Super.numJnlBlocks    = %d \n", super->numJnlBlocks);
+  printf("Super.firstData       = %d \n", super->firstData);
+  printf("Super.numImages       = %d \n", super->numImages);
+  printf("Super.stripeBlocks    = %d \n", super->stripeBlocks);
   printf("\n"); fflush(stdout);
 
   // Check that remainder of Superblock is all zeroes
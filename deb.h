@@ -12,6 +12,7 @@
 i32 debDumpDbn   (i32 dbn, i32 size);
 i32 debDumpDir   ();
 i32 debDumpInodes();
+i32 debDumpStats ();
 i32 debDumpSuper ();
 
 #endif
\ No newline at end of file
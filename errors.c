@@ -6,7 +6,7 @@
 #include <stdlib.h>
 #include "errors.h"
 
-void pause() {
+void Pause() {
   printf("\nHit any key to finish ");
   getchar();
   exit(0);
@@ -17,56 +17,78 @@ void pause() {
 void RepTest(int err, str file, int line) {
   RepError(err);
   printf(" in file %s at line %d \n", file, line);
-  pause();
+  Pause();
 }
 
 
 void RepError(i32 e) {
   switch(e) {
     case EBADDBN:
-      printf("\nERROR: Bad DBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad DBN: negative or too large \n");    Pause(); break;
     case EBADFBN:
-      printf("\nERROR: Bad FBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad FBN: negative or too large \n");    Pause(); break;
     case EBADINUM:
-      printf("\nERROR: Bad Inum: negative or too large \n");   pause(); break;
+      printf("\nERROR: Bad Inum: negative or too large \n");   Pause(); break;
     case EBADCURS:
-      printf("\nERROR: Bad cursor within file \n");           pause(); break;
+      printf("\nERROR: Bad cursor within file \n");           Pause(); break;
     case EBADREAD:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         Pause(); break;
     case EBADWRITE:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         Pause(); break;
     case EBIGFNAME:
-      printf("\nERROR: Filename too big \n");                  pause(); break;
+      printf("\nERROR: Filename too big \n");                  Pause(); break;
     case EBIGNUMB:
-      printf("\nERROR: Read or write is too big \n");          pause(); break;
+      printf("\nERROR: Read or write is too big \n");          Pause(); break;
     case EDIRFULL:
-      printf("\nERROR: Directory is already full \n");         pause(); break;
+      printf("\nERROR: Directory is already full \n");         Pause(); break;
     case EDISKCREATE:
-      printf("\nERROR: Failure creating BFS disk \n");         pause(); break;
+      printf("\nERROR: Failure creating BFS disk \n");         Pause(); break;
     case EDISKFULL:
-      printf("\nERROR: Disk is full \n");                      pause(); break;
+      printf("\nERROR: Disk is full \n");                      Pause(); break;
     case EEXISTS:
-      printf("\nERROR: Format would destroy current disk \n"); pause(); break;
+      printf("\nERROR: Format would destroy current disk \n"); Pause(); break;
     case EFNF:
-      printf("\nERROR: File Not Found \n");                    pause(); break;
+      printf("\nERROR: File Not Found \n");                    Pause(); break;
     case ENEGNUMB:
-      printf("\nERROR: Negative # bytes in read or write \n"); pause(); break;
+      printf("\nERROR: Negative # bytes in read or write \n"); Pause(); break;
     case ENODBN:
-      printf("\nERROR: No DBN yet allocated - non-fatal \n");  pause(); break;
+      printf("\nERROR: No DBN yet allocated - non-fatal \n");  Pause(); break;
     case ENODISK:
-      printf("\nERROR: Cannot open the BFS disk \n");          pause(); break;
+      printf("\nERROR: Cannot open the BFS disk \n");          Pause(); break;
     case ENOMEM:
-      printf("\nERROR: Failure to malloc memory \n");          pause(); break;
+      printf("\nERROR: Failure to malloc memory \n");          Pause(); break;
     case ENULLPTR:
-      printf("\nERROR: About to deref a null pointer \n");     pause(); break;
+      printf("\nERROR: About to deref a null pointer \n");     Pause(); break;
     case ENYI:
-      printf("\nERROR: Function Note Yet Implemented \n");     pause(); break;
+      printf("\nERROR: Function Note Yet Implemented \n");     Pause(); break;
     case EOFTFULL:
-      printf("\nERROR: OpenFileTable is full \n");             pause(); break;
+      printf("\nERROR: OpenFileTable is full \n");             Pause(); break;
+    case ENOEXTENT:
+      printf("\nERROR: File has too many Extents \n");        Pause(); break;
+    case EBADGEOM:
+      printf("\nERROR: Invalid disk geometry \n");            Pause(); break;
+    case EBADJNL:
+      printf("\nERROR: Journal is corrupt \n");               Pause(); break;
+    case EPINNED:
+      printf("\nERROR: Block cache is pinned by the journal \n"); Pause(); break;
+    case EBADFDESC:
+      printf("\nERROR: File Descriptor is not open \n");     Pause(); break;
+    case EFDTFULL:
+      printf("\nERROR: File Descriptor Table is full \n");   Pause(); break;
+    case EBADASY:
+      printf("\nERROR: Bad async request \n");               Pause(); break;
+    case EFILEOPEN:
+      printf("\nERROR: File is open, so cannot be deleted \n"); Pause(); break;
+    case EBADPRF:
+      printf("\nERROR: Bad performance counter request \n");  Pause(); break;
+    case EBADTRC:
+      printf("\nERROR: Trace file cannot be read or written \n"); Pause(); break;
+    case EJNLFULL:
+      printf("\nERROR: Operation does not fit in the journal \n"); Pause(); break;
     case EBADWHENCE:
-      printf("\nERROR: Invalid 'whence' in fsSeek \n");        pause(); break;
+      printf("\nERROR: Invalid 'whence' in fsSeek \n");        Pause(); break;
     default:
-      printf("\nERROR: Miscellaneous error \n");               pause(); break;
+      printf("\nERROR: Miscellaneous error \n");               Pause(); break;
   }
 }
 
@@ -29,8 +29,19 @@ void RepTest(int err, str file, int line);
 #define ENULLPTR    -19   // about to deref a NULL pointer
 #define ENYI        -20   // not yet implemented
 #define EOFTFULL    -21   // OpenFileTable is full
+#define ENOEXTENT   -22   // Inode has no room for another Extent
+#define EBADGEOM    -23   // invalid disk geometry for fsFormat
+#define EBADJNL     -24   // journal region is corrupt
+#define EPINNED     -25   // block cache is all pinned by the journal
+#define EBADFDESC   -26   // File Descriptor is not open
+#define EFDTFULL    -27   // File Descriptor Table is full
+#define EBADASY     -28   // bad async request, or asyInit not called
+#define EFILEOPEN   -29   // file is open, so cannot be deleted
+#define EBADPRF     -30   // bad performance counter operation or format
+#define EBADTRC     -31   // trace file cannot be read or written
+#define EJNLFULL    -32   // operation needs more blocks than the journal holds
 
-void pause();
+void Pause();
 void RepError(i32 ret);
 
 #endif
\ No newline at end of file
@@ -1,78 +1,410 @@
 // ============================================================================
 // fs.c - user FileSytem API
+//
+// Calls on different files may run on many threads at once; calls on one
+// file share its Inode lock (readers) or hold it alone (writers).  fsFormat,
+// fsMount and fsUnmount must not overlap any other call
 // ============================================================================
 
 #include "bfs.h"
 #include "fs.h"
+#include "prf.h"
+#include "trc.h"
+
+static i32 g_numImages    = 1;            // striping for the next fsFormat
+static i32 g_stripeBlocks = 1;
+
+// ============================================================================
+// Number of blocks touched by 'numb' bytes starting at byte 'cursor'
+// ============================================================================
+static i64 spanBlocks(i32 cursor, i32 numb) {
+  if (numb <= 0) return 0;
+  return ((i64)cursor + numb - 1) / BYTESPERBLOCK - cursor / BYTESPERBLOCK + 1;
+}
+
+
+
+// ============================================================================
+// Return the size in bytes of the file open on File Descriptor 'fd'.  On
+// failure, abort
+// ============================================================================
+static i32 sizeOf(i32 fd) {
+  i32 inum = bfsFdToInum(fd);
+  bfsLockInode(inum, 0);
+  i32 size = bfsGetSize(inum);
+  bfsUnlockInode(inum);
+  return size;
+}
+
+
+
+// ============================================================================
+// Read 'numb' bytes of file 'inum', open on 'fd', starting at byte 'cursor',
+// into 'buf', then let 'fd' read ahead.  Return the number of bytes read
+// (less than 'numb' at EOF).  Caller holds the file's Inode lock.  On
+// failure, abort
+// ============================================================================
+static i32 readAt(i32 fd, i32 inum, i32 cursor, i32 numb, void* buf) {
+  //check how much to read to neg and file size
+  if(numb <= 0){ FATAL(ENEGNUMB); }
+  i32 fSize = bfsGetSize(inum);
+  if(numb > fSize){ FATAL(EBIGNUMB); }
+  
+  //check if cursor is valid; files, sparse ones too, may outgrow the disk
+  if(cursor < 0 || cursor > MAXFSIZE){ FATAL(EBADCURS); }
+
+  //setup for reading, stopping at the end of the file
+  i32 startRead = cursor; //where to start reading
+  if((i64)startRead + numb > fSize){
+    numb = fSize - startRead;
+  }
+  i32 endRead = startRead + numb; //where to stop reading
+  if(numb <= 0){ return 0; } //cursor at EOF
+
+  //blocks wholly inside the read go straight into 'buf'; only a partial
+  //first or last block is bounced through one block of stack
+  i8* out = (i8*)buf;
+  i8 bounce[BYTESPERBLOCK];
+  i32 done = 0;
+
+  //partial first block
+  i32 offset = startRead % BYTESPERBLOCK;
+  if(offset != 0 || numb < BYTESPERBLOCK){
+    done = BYTESPERBLOCK - offset;
+    if(done > numb){ done = numb; }
+    bfsReadRange(inum, startRead / BYTESPERBLOCK, 1, bounce);
+    memcpy(out, bounce + offset, done);
+  }
+
+  //whole blocks, adjacent ones in one go
+  i32 whole = (numb - done) / BYTESPERBLOCK;
+  if(whole > 0){
+    bfsReadRange(inum, (startRead + done) / BYTESPERBLOCK, whole, out + done);
+    done += whole * BYTESPERBLOCK;
+  }
+
+  //partial last block
+  if(done < numb){
+    bfsReadRange(inum, (startRead + done) / BYTESPERBLOCK, 1, bounce);
+    memcpy(out + done, bounce, numb - done);
+  }
+
+  //prefetch what a streaming reader will want next
+  i32 firstFBN = startRead / BYTESPERBLOCK;
+  i32 lastFBN = (endRead - 1) / BYTESPERBLOCK;
+  bfsReadAhead(fd, inum, firstFBN, lastFBN - firstFBN + 1);
+
+  return numb;
+}
+
+
+
+// ============================================================================
+// Write as much as one journal operation has room to allocate of 'numb'
+// bytes from 'buf' into file 'inum', starting at byte 'cursor', extending
+// the file if need be.  Only the blocks written are allocated; any gap
+// left before them stays a hole.  Return the number of bytes written.
+// Caller holds the file's Inode lock for writing, and is in an operation.
+// On failure, abort
+// ============================================================================
+static i32 writeOp(i32 inum, i32 cursor, i32 numb, void* buf) {
+  //setup, last FBN is the one holding the final byte written
+  i32 endWrite = cursor + numb;
+  i32 endFBN = (endWrite - 1) / BYTESPERBLOCK;
+
+  //allocate the blocks written that are still holes.  A partial block new
+  //to the file starts out as zeros, not whatever the disk held there.  If
+  //the operation fills up first, write just the blocks it mapped
+  i32 firstFBN = cursor / BYTESPERBLOCK;
+  i32 newFirst = bfsFbnToDbn(inum, firstFBN) == ENODBN;
+  i32 newLast = bfsFbnToDbn(inum, endFBN) == ENODBN;
+  i32 mapped = bfsAllocRange(inum, firstFBN, endFBN - firstFBN + 1);
+  if(firstFBN + mapped <= endFBN){
+    endFBN = firstFBN + mapped - 1;
+    endWrite = (endFBN + 1) * BYTESPERBLOCK;
+    numb = endWrite - cursor;
+    newLast = 0; //written whole, or it is the first block
+  }
+
+  //check if file size is ok, if not, make adjustments
+  if(endWrite > bfsGetSize(inum)){
+    bfsSetSize(inum, endWrite);
+  }
+
+  //blocks wholly inside the write go straight from 'buf' to disk; only a
+  //partial first or last block is read, patched and left dirty in the
+  //cache, so small writes to one block share a disk write
+  i8* in = (i8*)buf;
+  i8 bounce[BYTESPERBLOCK];
+  i32 done = 0;
+
+  //partial first block
+  i32 offset = cursor % BYTESPERBLOCK;
+  if(offset != 0 || numb < BYTESPERBLOCK){
+    done = BYTESPERBLOCK - offset;
+    if(done > numb){ done = numb; }
+    if(newFirst){ memset(bounce, 0, BYTESPERBLOCK); }
+    else{ bfsRead(inum, firstFBN, bounce); }
+    memcpy(bounce + offset, in, done);
+    bfsWrite(inum, firstFBN, bounce);
+  }
+
+  //whole blocks, adjacent ones in one go
+  i32 whole = (numb - done) / BYTESPERBLOCK;
+  if(whole > 0){
+    bfsWriteRange(inum, (cursor + done) / BYTESPERBLOCK, whole, in + done);
+    done += whole * BYTESPERBLOCK;
+  }
+
+  //partial last block
+  if(done < numb){
+    if(newLast){ memset(bounce, 0, BYTESPERBLOCK); }
+    else{ bfsRead(inum, endFBN, bounce); }
+    memcpy(bounce, in + done, numb - done);
+    bfsWrite(inum, endFBN, bounce);
+  }
+  return numb;
+}
+
+
+
+// ============================================================================
+// Write 'numb' bytes from 'buf' into file 'inum', starting at byte 'cursor',
+// as one journal operation, or as several in turn when it needs more blocks
+// than one can hold: each commits whole, with the file's size covering
+// just the bytes written so far.  Caller holds the file's Inode lock for
+// writing.  On failure, abort
+// ============================================================================
+static void writeAt(i32 inum, i32 cursor, i32 numb, void* buf) {
+  //some error handling
+  if(numb <= 0){ FATAL(ENEGNUMB); }
+  if(numb >= ((i64)BYTESPERBLOCK * BLOCKSPERDISK)){ FATAL(EBIGNUMB); }
+  if(cursor < 0 || cursor >= MAXFSIZE){ FATAL(EBADCURS); }
+  if((i64)cursor + numb > MAXFSIZE){ FATAL(EBIGNUMB); }
+
+  i32 done = 0;
+  while(done < numb){
+    jnlBegin();
+    done += writeOp(inum, cursor + done, numb - done, (i8*)buf + done);
+    bfsSyncInode(inum);
+    jnlEnd();
+  }
+}
+
+
 
 // ============================================================================
 // Close the file currently open on file descriptor 'fd'.
 // ============================================================================
 i32 fsClose(i32 fd) { 
-  i32 inum = bfsFdToInum(fd);
+  i64 t0 = prfBegin(PRFFSCLOSE);
+  i64 tr = trcBegin();
+  i32 inum = bfsCloseFd(fd);
   bfsDerefOFT(inum);
+  if (jnlFull()) bfsCommit();                 // group commit
+  trcEnd(TRCCLOSE, tr, NULL, fd, 0, 0, 0);
+  prfEnd(PRFFSCLOSE, t0, 0, 0);
   return 0; 
 }
 
 
 
 // ============================================================================
-// Create the file called 'fname'.  Overwrite, if it already exsists.
+// Create the file called 'fname'.  Overwrite, if it already exists: it is
+// truncated to nothing, its blocks freed at the commit made before return.
 // On success, return its file descriptor.  On failure, EFNF
 // ============================================================================
 i32 fsCreate(str fname) {
+  i64 t0 = prfBegin(PRFFSCREATE);
+  i64 tr = trcBegin();
+  jnlBegin();
   i32 inum = bfsCreateFile(fname);
-  if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  jnlEnd();
+  i32 fd   = EFNF;
+  if (inum != EFNF) {
+    bfsLockInode(inum, 1);
+    jnlBegin();
+    i32 shrink = bfsGetSize(inum) > 0;        // it already existed
+    if (shrink) bfsTruncate(inum, 0);
+    bfsSyncInode(inum);
+    jnlEnd();
+    bfsUnlockInode(inum);
+
+    if (shrink || jnlFull()) bfsCommit();     // frees the old blocks
+    fd = bfsOpenFd(inum);
+  }
+  trcEnd(TRCCREATE, tr, fname, 0, 0, 0, fd);
+  prfEnd(PRFFSCREATE, t0, 0, 0);
+  return fd;
 }
 
 
 
 // ============================================================================
-// Format the BFS disk by initializing the SuperBlock, Inodes, Directory and 
-// Freelist.  On succes, return 0.  On failure, abort
+// Delete the file called 'fname'.  Its blocks go back to the allocator in
+// one batch, at the commit made before return.  On success, return 0.  If
+// there is no such file, return EFNF; if it is open, return EFILEOPEN
 // ============================================================================
-i32 fsFormat() {
-  FILE* fp = fopen(BFSDISK, "w+b");
-  if (fp == NULL) FATAL(EDISKCREATE);
+i32 fsDelete(str fname) {
+  i64 t0  = prfBegin(PRFFSDELETE);
+  i64 tr  = trcBegin();
+  jnlBegin();
+  i32 ret = bfsDeleteFile(fname);
+  jnlEnd();
+  if (ret == 0) bfsCommit();                  // frees the blocks
+  trcEnd(TRCDELETE, tr, fname, 0, 0, 0, ret);
+  prfEnd(PRFFSDELETE, t0, 0, 0);
+  return ret;
+}
+
 
-  i32 ret = bfsInitSuper(fp);               // initialize Super block
-  if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  ret = bfsInitInodes(fp);                  // initialize Inodes block
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+// ============================================================================
+// Format the BFS disk, with 'numBlocks' blocks of 'blockSize' bytes and room
+// for 'numInodes' files, by initializing the SuperBlock, Inodes, Directory
+// and free-block Bitmap.  The disk is striped as set by fsStripe.  On
+// succes, return 0.  On failure, abort
+// ============================================================================
+i32 fsFormat(i32 numBlocks, i32 blockSize, i32 numInodes) {
+  trcEnv();
+  i64 tr = trcBegin();
+  jnlClose();                               // flush any disk still mounted
+  bioClose();
+  bfsMakeSuper(numBlocks, blockSize, numInodes, g_numImages, g_stripeBlocks);
 
-  ret = bfsInitDir(fp);                     // initialize Dir block
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+  bioCreate(BFSDISK);                       // create or empty the disk
+  bioStripe(NUMIMAGES, STRIPEBLOCKS, 1);    // creates BFSDISK.1 ..
+  bioExtend(BLOCKSPERDISK);                 // every image at full size
 
-  ret = bfsInitFreeList();                  // initialize Freelist
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+  i32 ret = bfsInitSuper();                 // initialize Super block
+  if (ret != 0) FATAL(ret);
 
-  fclose(fp);
+  ret = bfsInitInodes();                    // initialize Inodes blocks
+  if (ret != 0) FATAL(ret);
+
+  ret = bfsInitDir();                       // initialize Dir blocks
+  if (ret != 0) FATAL(ret);
+
+  ret = bfsInitBitmap();                    // initialize Bitmap
+  if (ret != 0) FATAL(ret);
+
+  ret = jnlInit();                          // initialize empty journal
+  if (ret != 0) FATAL(ret);
+
+  bioClose();
+  trcEnd(TRCFORMAT, tr, NULL, numBlocks, blockSize, numInodes, 0);
   return 0;
 }
 
 
 // ============================================================================
-// Mount the BFS disk.  It must already exist
+// Make the file open on File Descriptor 'fd' durable: write its dirty
+// cached blocks home, commit its Inode and block map to the journal, and
+// wait until both are stable.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 fsMount() {
-  FILE* fp = fopen(BFSDISK, "rb");
-  if (fp == NULL) FATAL(ENODISK);           // BFSDISK not found
-  fclose(fp);
+i32 fsFsync(i32 fd) {
+  i32 inum = bfsFdToInum(fd);
+  i64 t0   = prfBegin(PRFFSFSYNC);
+  i64 tr   = trcBegin();
+  bfsLockInode(inum, 0);
+  bfsFlushFile(inum);
+  bfsUnlockInode(inum);
+
+  bfsCommit();
+  bioSync();
+  trcEnd(TRCFSYNC, tr, NULL, fd, 0, 0, 0);
+  prfEnd(PRFFSFSYNC, t0, 0, 0);
   return 0;
 }
 
 
 
+// ============================================================================
+// Mount the BFS disk.  It must already exist.  Its geometry is read from the
+// Super block.  Metadata changes committed to the journal before a crash
+// are replayed.  The disk stays open until fsUnmount, so block IO does not
+// pay an open/close per block.  The Open File and File Descriptor Tables
+// start out empty
+// ============================================================================
+i32 fsMount() {
+  trcEnv();
+  i64 tr = trcBegin();
+  bfsInitOFT();
+  bioOpen(BFSDISK);
+  bfsLoadSuper();
+  jnlOpen();                                // replay committed metadata
+  bfsLoadBitmap();
+  bfsLoadDir();
+  i32 ret = bfsLoadInodes();
+  trcEnd(TRCMOUNT, tr, NULL, 0, 0, 0, ret);
+  return ret;
+}
+
+
+
 // ============================================================================
 // Open the existing file called 'fname'.  On success, return its file 
 // descriptor.  On failure, return EFNF
 // ============================================================================
 i32 fsOpen(str fname) {
+  i64 t0   = prfBegin(PRFFSOPEN);
+  i64 tr   = trcBegin();
   i32 inum = bfsLookupFile(fname);        // lookup 'fname' in Directory
-  if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  i32 fd   = (inum == EFNF) ? EFNF : bfsOpenFd(inum);
+  trcEnd(TRCOPEN, tr, fname, 0, 0, 0, fd);
+  prfEnd(PRFFSOPEN, t0, 0, 0);
+  return fd;
+}
+
+
+
+// ============================================================================
+// Commit all metadata changes, including dirty Inodes, to the journal, then
+// write all cached blocks to the BFS disk, and wait until they are stable
+// ============================================================================
+i32 fsSync() {
+  i64 t0 = prfBegin(PRFFSSYNC);
+  i64 tr = trcBegin();
+  bfsCommit();
+  bioFlush();
+  bioSync();
+  trcEnd(TRCSYNC, tr, NULL, 0, 0, 0, 0);
+  prfEnd(PRFFSSYNC, t0, 0, 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Unmount the BFS disk mounted by fsMount, releasing its handle
+// ============================================================================
+i32 fsUnmount() {
+  i64 tr = trcBegin();
+  bfsCommit();                              // frees any queued blocks
+  jnlClose();
+  i32 ret = bioClose();
+  trcEnd(TRCUNMOUNT, tr, NULL, 0, 0, 0, ret);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Read 'numb' bytes of data from byte 'offset' of the file currently fsOpen'd
+// on File Descriptor 'fd' into 'buf'.  The descriptor's cursor is neither
+// used nor moved.  On success, return actual number of bytes read (may be
+// less than 'numb' if we hit EOF).  On failure, abort
+// ============================================================================
+i32 fsPread(i32 fd, i32 numb, void* buf, i32 offset) {
+  i32 inum = bfsFdToInum(fd);
+  i64 t0   = prfBegin(PRFFSPREAD);
+  i64 tr   = trcBegin();
+  bfsLockInode(inum, 0);
+  i32 ret = readAt(fd, inum, offset, numb, buf);
+  bfsUnlockInode(inum);
+  trcEnd(TRCPREAD, tr, NULL, fd, numb, offset, ret);
+  prfEnd(PRFFSPREAD, t0, ret, spanBlocks(offset, ret));
+  return ret;
 }
 
 
@@ -83,50 +415,24 @@ i32 fsOpen(str fname) {
 // read (may be less than 'numb' if we hit EOF).  On failure, abort
 // ============================================================================
 i32 fsRead(i32 fd, i32 numb, void* buf) {
-  //check how much to read to neg and file size
-  if(numb <= 0){ FATAL(ENEGNUMB); }
-  i32 fSize = fsSize(fd);
-  if(numb > fSize){ FATAL(EBIGNUMB); }
-  
-  //setup cursor for reading
-  i32 cursor = fsTell(fd); //get the files cursor position
-  i32 startRead = cursor; //where to start reading
-  i32 endRead = startRead + numb; //where to stop reading
-  //check if cursor is valid
-  if(cursor < 0 || cursor >= (BYTESPERBLOCK * BLOCKSPERDISK)){ FATAL(EBADCURS); }
-
-  //check if numb from cursor goes past end of the file
-  if(endRead > fSize){
-    numb = fSize - startRead;
-    endRead = startRead + numb;
-  }
-  
-  //setup read buffer
-  i32 startFbn = startRead / BYTESPERBLOCK;
-  i32 endFBN = endRead / BYTESPERBLOCK;
-  i8 readBuffer[(endFBN - startFbn + 1) * BYTESPERBLOCK];
-  i8 tempBuffer[BYTESPERBLOCK];
-  i32 offset = 0;
+  //readers share the file's Inode lock
   i32 inum = bfsFdToInum(fd); //get inum to the file
-  i32 read;
-
-  //read from disk into buffer
-  for(i32 i = startFbn; i <= endFBN; i++){
-    read = bfsRead(inum, i, tempBuffer);
-    if(read > 0 || read < 0){ FATAL(EBADREAD); } //bad read error handling
-    memcpy((readBuffer + offset), tempBuffer, BYTESPERBLOCK);
-    //printf("cursor: %d\n", fsTell(fd));
-    offset += BYTESPERBLOCK;
-  }
-
-  //move into og buffer and move curosr
-  memcpy(buf, (readBuffer + (cursor % BYTESPERBLOCK)), numb);
-  fsSeek(fd, numb, SEEK_CUR);
-
-  return numb;
+  i64 t0   = prfBegin(PRFFSREAD);
+  i64 tr   = trcBegin();
+  bfsLockInode(inum, 0);
+
+  i32 cursor = bfsTell(fd); //get this descriptor's cursor position
+  i32 ret = readAt(fd, inum, cursor, numb, buf);
+  bfsSetCursor(fd, cursor + ret); //move cursor
+
+  bfsUnlockInode(inum);
+  trcEnd(TRCREAD, tr, NULL, fd, numb, 0, ret);
+  prfEnd(PRFFSREAD, t0, ret, spanBlocks(cursor, ret));
+  return ret;
 }
 
 
+
 // ============================================================================
 // Move the cursor for the file currently open on File Descriptor 'fd' to the
 // byte-offset 'offset'.  'whence' can be any of:
@@ -135,30 +441,46 @@ i32 fsRead(i32 fd, i32 numb, void* buf) {
 //  SEEK_CUR : add 'offset' to the current cursor
 //  SEEK_END : add 'offset' to the size of the file
 //
-// On success, return 0.  On failure, abort
+// A cursor moved past the end of the file makes the file that big; the gap
+// is a hole, read as zeros and given blocks only when written.  The cursor
+// may go as far as MAXFSIZE, however small the disk.  On success, return
+// 0.  On failure, abort
 // ============================================================================
 i32 fsSeek(i32 fd, i32 offset, i32 whence) {
 
   if (offset < 0) FATAL(EBADCURS);
- 
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  
+
+  i64 t0 = prfBegin(PRFFSSEEK);
+  i64 tr = trcBegin();
+
+  i64 curs = 0;
   switch(whence) {
     case SEEK_SET:
-      g_oft[ofte].curs = offset;
+      curs = offset;
       break;
     case SEEK_CUR:
-      g_oft[ofte].curs += offset;
+      curs = (i64)bfsTell(fd) + offset;
       break;
-    case SEEK_END: {
-      i32 end = fsSize(fd);
-      g_oft[ofte].curs = end + offset;
+    case SEEK_END:
+      curs = (i64)sizeOf(fd) + offset;
       break;
-    }
     default:
       FATAL(EBADWHENCE);
   }
+  if (curs > MAXFSIZE) FATAL(EBADCURS);             // past any file
+
+  if (curs > sizeOf(fd)) {
+    i32 inum = bfsFdToInum(fd);
+    bfsLockInode(inum, 1);
+    jnlBegin();
+    if (curs > bfsGetSize(inum)) bfsSetSize(inum, curs);
+    bfsSyncInode(inum);
+    jnlEnd();
+    bfsUnlockInode(inum);
+  }
+  bfsSetCursor(fd, curs);
+  trcEnd(TRCSEEK, tr, NULL, fd, offset, whence, 0);
+  prfEnd(PRFFSSEEK, t0, 0, 0);
   return 0;
 }
 
@@ -168,7 +490,10 @@ i32 fsSeek(i32 fd, i32 offset, i32 whence) {
 // Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
 i32 fsTell(i32 fd) {
-  return bfsTell(fd);
+  i64 tr   = trcBegin();
+  i32 curs = bfsTell(fd);
+  trcEnd(TRCTELL, tr, NULL, fd, 0, 0, curs);
+  return curs;
 }
 
 
@@ -179,71 +504,103 @@ i32 fsTell(i32 fd) {
 // success, return the file size.  On failure, abort
 // ============================================================================
 i32 fsSize(i32 fd) {
+  i64 tr   = trcBegin();
+  i32 size = sizeOf(fd);
+  trcEnd(TRCSIZE, tr, NULL, fd, 0, 0, size);
+  return size;
+}
+
+
+
+// ============================================================================
+// Make each later fsFormat stripe the disk over 'numImages' image files -
+// BFSDISK, then BFSDISK.1, BFSDISK.2 .. - 'stripeBlocks' blocks at a time,
+// so large transfers move to and from every image in parallel.  A mounted
+// disk keeps the striping it was formatted with.  On success, return 0.
+// On failure, abort
+// ============================================================================
+i32 fsStripe(i32 numImages, i32 stripeBlocks) {
+  if (numImages < 1 || numImages > BIOMAXIMAGES) FATAL(EBADGEOM);
+  if (stripeBlocks < 1)                          FATAL(EBADGEOM);
+  trcEnv();
+  i64 tr = trcBegin();
+  g_numImages    = numImages;
+  g_stripeBlocks = stripeBlocks;
+  trcEnd(TRCSTRIPE, tr, NULL, numImages, stripeBlocks, 0, 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Set the size of the file open on File Descriptor 'fd' to 'size' bytes.
+// Growing leaves a hole, read as zeros.  Shrinking frees the blocks past
+// the new end, in one batch, at the commit made before return.  Cursors
+// are not moved.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsTruncate(i32 fd, i32 size) {
+
+  if (size < 0) FATAL(ENEGNUMB);
+
   i32 inum = bfsFdToInum(fd);
-  return bfsGetSize(inum);
+  i64 t0   = prfBegin(PRFFSTRUNCATE);
+  i64 tr   = trcBegin();
+  bfsLockInode(inum, 1);
+  jnlBegin();
+  i32 shrink = size < bfsGetSize(inum);
+  bfsTruncate(inum, size);
+  bfsSyncInode(inum);
+  jnlEnd();
+  bfsUnlockInode(inum);
+
+  if (shrink || jnlFull()) bfsCommit();       // frees the blocks
+  trcEnd(TRCTRUNCATE, tr, NULL, fd, size, 0, 0);
+  prfEnd(PRFFSTRUNCATE, t0, 0, 0);
+  return 0;
 }
 
 
 
 // ============================================================================
 // Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
-// filedescriptor 'fd'.  The write starts at the current file offset for the
-// destination file.  On success, return 0.  On failure, abort
+// File Descriptor 'fd', starting at byte 'offset'.  The descriptor's cursor
+// is neither used nor moved.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 fsWrite(i32 fd, i32 numb, void* buf) {
-  //setup
-  i32 cursor = fsTell(fd);
-  i32 startFBN = cursor / BYTESPERBLOCK;
-  i32 endFBN = (cursor + numb) / BYTESPERBLOCK;
+i32 fsPwrite(i32 fd, i32 numb, void* buf, i32 offset) {
   i32 inum = bfsFdToInum(fd);
-  i32 blockCount = endFBN - startFBN + 1;
+  i64 t0   = prfBegin(PRFFSPWRITE);
+  i64 tr   = trcBegin();
+  bfsLockInode(inum, 1);
+  writeAt(inum, offset, numb, buf);
+  bfsUnlockInode(inum);
+
+  if(jnlFull()){ bfsCommit(); } //group commit
+  trcEnd(TRCPWRITE, tr, NULL, fd, numb, offset, 0);
+  prfEnd(PRFFSPWRITE, t0, numb, spanBlocks(offset, numb));
+  return 0;
+}
 
-  //some error handling
-  if(numb <= 0){ FATAL(ENEGNUMB); }
-  if(numb >= (BYTESPERBLOCK * BLOCKSPERDISK)){ FATAL(EBIGNUMB); }
-  if(cursor < 0 || cursor >= (BYTESPERBLOCK * BLOCKSPERDISK)){ FATAL(EBADCURS); }
-  if(blockCount > 5 || blockCount <= 0) { FATAL(EBADFBN); }
-  if(fsSize(fd) <= 0) { FATAL(EBADINUM); }
 
-  //check if file size is ok, if not, make adjustments
-  if(endFBN > ((fsSize(fd) - 1) / BYTESPERBLOCK)){
-    bfsExtend(inum, endFBN);
-    bfsSetSize(inum, cursor + numb);
-  }
-  
-  //setup read/write buffers
-  i8 bioBuff[blockCount * BYTESPERBLOCK];
-  i8 tempBuff[BYTESPERBLOCK];
-
-  //copy first block
-  i32 bad = bfsRead(inum, startFBN, tempBuff);
-  if(bad < 0 || bad > 0) { FATAL(EBADREAD); } //check read was good
-  memcpy(bioBuff, tempBuff, BYTESPERBLOCK);
-
-  //copy last black, edge holders
-  bad = bfsRead(inum, endFBN, tempBuff);
-  if(bad < 0 || bad > 0) { FATAL(EBADREAD); } //check if read was good
-  memcpy((bioBuff + (blockCount - 1) * BYTESPERBLOCK), tempBuff, BYTESPERBLOCK);
-
-  //copy buf (new data) into bioBuff to be placed into blocks later
-  memcpy((bioBuff + (cursor % BYTESPERBLOCK)), buf, numb);
-
-  //get FBN to DBN, setup copy
-  i32 dbn;
-  i32 offset = 0;
-  
-  //copy meat into blocks
-  for(i32 i = startFBN; i <= endFBN; i++){
-    memcpy(tempBuff, bioBuff + offset, BYTESPERBLOCK);
-    dbn = ENODBN; //for testing validity
-    dbn = bfsFbnToDbn(inum, i);
-    //printf("dbn: %d\n", dbn);
-    if(dbn == ENODBN) { FATAL(EBADDBN); } //bad dbn
-    bad = bioWrite(dbn, tempBuff);
-    if(bad < 0 || bad > 0) { FATAL(EBADWRITE); } //check for bad write
-    offset += BYTESPERBLOCK;
-  }
 
-  fsSeek(fd, numb, SEEK_CUR); //move cursor to new pos
+// ============================================================================
+// Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
+// filedescriptor 'fd'.  The write starts at the current file offset for the
+// destination file.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsWrite(i32 fd, i32 numb, void* buf) {
+  //a writer holds the file's Inode lock alone
+  i32 inum = bfsFdToInum(fd);
+  i64 t0   = prfBegin(PRFFSWRITE);
+  i64 tr   = trcBegin();
+  bfsLockInode(inum, 1);
+
+  i32 cursor = bfsTell(fd);
+  writeAt(inum, cursor, numb, buf);
+  bfsSetCursor(fd, cursor + numb); //move cursor to new pos
+  bfsUnlockInode(inum);
+
+  if(jnlFull()){ bfsCommit(); } //group commit
+  trcEnd(TRCWRITE, tr, NULL, fd, numb, 0, 0);
+  prfEnd(PRFFSWRITE, t0, numb, spanBlocks(cursor, numb));
   return 0; //good write
 }
\ No newline at end of file
@@ -12,13 +12,21 @@
 
 i32 fsClose (i32 fd);
 i32 fsCreate(str name);
-i32 fsFormat();
+i32 fsDelete(str fname);
+i32 fsFormat(i32 numBlocks, i32 blockSize, i32 numInodes);
+i32 fsFsync (i32 fd);
 i32 fsMount();
 i32 fsOpen  (str fname);
+i32 fsPread (i32 fd, i32 numb,   void* buf, i32 offset);
+i32 fsPwrite(i32 fd, i32 numb,   void* buf, i32 offset);
 i32 fsRead  (i32 fd, i32 numb,   void* buf);
 i32 fsSeek  (i32 fd, i32 offset, i32   whence);
 i32 fsSize  (i32 fd);
+i32 fsStripe(i32 numImages, i32 stripeBlocks);
+i32 fsSync  ();
 i32 fsTell  (i32 fd);
+i32 fsTruncate(i32 fd, i32 size);
+i32 fsUnmount();
 i32 fsWrite (i32 fd, i32 numb,   void* buf);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,507 @@
+// ============================================================================
+// jnl.c - write-ahead journal of BFS metadata blocks
+//
+// Metadata blocks (bitmap, Inodes, Directory, Extent and pointer blocks)
+// are written with jnlWrite.  Each lands in the buffer cache, pinned, and
+// joins the running transaction.  jnlCommit writes the whole transaction
+// to the log with one syscall, waits for it to be stable, then unpins the
+// blocks so normal writeback can take them home.  Many fs* operations thus
+// share one journal write.  On mount, jnlOpen replays every intact
+// transaction in the log, so a crash leaves the metadata as of the last
+// commit.  Dirty file data in the cache is written home before each
+// commit, so committed metadata never maps blocks not yet written.  One
+// mutex serializes journal writes and commits.  A block written again
+// after its commit stays pinned, so a checkpoint writes its committed copy
+// home from the log before the log is emptied
+//
+// Each change to the metadata runs as an operation, between jnlBegin and
+// jnlEnd, and a transaction only ever commits between operations: a crash
+// never leaves half of one on disk, such as bitmap bits set for blocks its
+// Inode does not map yet.  jnlBegin reserves room in the running
+// transaction for JNLOPBLOCKS blocks, committing it first if it is too
+// full; an operation that needs more asks with jnlReserve
+// ============================================================================
+
+#include <pthread.h>
+
+#include "bfs.h"
+#include "jnl.h"
+#include "prf.h"
+
+#define FNVBASIS 2166136261u             // jnlSum of no bytes
+
+static i32  g_open = 0;                  // 1 => journal in use
+static i32  g_cap  = 0;                  // most blocks in a transaction
+static i32* g_dbns = NULL;               // home DBNs in running transaction
+static i32  g_n    = 0;                  // # of DBNs in 'g_dbns'
+static i32  g_seq  = 0;                  // sequence # of running transaction
+static i32  g_head = 0;                  // next free log block
+static i32* g_logged = NULL;             // [pos]: home DBN of log block pos
+static i8*  g_stage = NULL;              // a transaction, as laid out in log
+static i32  g_active   = 0;              // # of operations in progress
+static i32  g_reserved = 0;              // blocks they may still add
+static i32  g_paused   = 0;              // 1 => jnlPause holds operations off
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards journal
+static pthread_cond_t  g_opCond = PTHREAD_COND_INITIALIZER; // op or pause ended
+
+static __thread i32 t_op     = 0;        // 1 => this thread is in an operation
+static __thread i32 t_res    = 0;        // blocks it may still add
+static __thread i32 t_wrote  = 0;        // # of jnlWrites it has made
+static __thread i32 t_paused = 0;        // 1 => this thread holds jnlPause
+
+// ============================================================================
+// Most blocks one descriptor can list, or the log can hold
+// ============================================================================
+static i32 jnlMaxBlocks() {
+  i32 n = (BYTESPERBLOCK - sizeof(JnlBlock)) / sizeof(i32);
+  if (n > NUMJNLBLOCKS - 3) n = NUMJNLBLOCKS - 3;
+  return n;
+}
+
+
+
+// ============================================================================
+// Continue FNV-1a checksum 'h' over 'numb' bytes at 'p'
+// ============================================================================
+static u32 jnlSum(u32 h, i8* p, i64 numb) {
+  for (i64 i = 0; i < numb; ++i) { h ^= (u8)p[i]; h *= 16777619u; }
+  return h;
+}
+
+
+
+// ============================================================================
+// Write the journal head block, naming 'seq' as the first transaction in
+// the log, and wait for it to be stable.  The log restarts after it
+// ============================================================================
+static void jnlWriteHead(i32 seq) {
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  JnlBlock* jb = (JnlBlock*)buf;
+  jb->magic = JNLMAGIC;
+  jb->type  = JNLHEAD;
+  jb->seq   = seq;
+  bioWriteRange(DBNJNL, 1, buf);
+  bioSync();
+  g_head = 1;
+}
+
+
+
+// ============================================================================
+// Write home the latest committed copy, from the log, of each block the
+// running transaction has pinned.  Such a block holds uncommitted data in
+// the cache, so bioFlush leaves it behind, yet its committed copy in the
+// log is about to be dropped.  The pinned copy stays as it is.  Caller
+// holds g_lock
+// ============================================================================
+static void jnlHomePinned() {
+  i8 buf[BYTESPERBLOCK];
+  for (i32 i = 0; i < g_n; ++i) {
+    i32 pos = g_head - 1;
+    while (pos > 0 && g_logged[pos] != g_dbns[i]) --pos;
+    if (pos == 0) continue;              // not committed since last head
+    bioReadRange(DBNJNL + pos, 1, buf);
+    bioWriteHome(g_dbns[i], buf);
+  }
+}
+
+
+
+// ============================================================================
+// Empty the log: write every committed block home, then restart the log
+// at the running transaction.  Caller holds g_lock
+// ============================================================================
+static void jnlCheckpointLocked() {
+  bioFlush();                            // pinned blocks stay behind
+  jnlHomePinned();                       // so their committed copies go
+  bioSync();
+  jnlWriteHead(g_seq);
+}
+
+
+
+// ============================================================================
+// Write the running transaction to the log: descriptor, block copies and
+// commit block, with one syscall.  Once stable, its blocks are unpinned.
+// If the log has no room, it is checkpointed first.  Caller holds g_lock
+// ============================================================================
+static void jnlCommitLocked() {
+  if (!g_open || g_n == 0) return;
+
+  i64 t0 = prfBegin(PRFJNLCOMMIT);
+  i32 n  = g_n + 2;                      // log blocks written
+  if (g_head + g_n + 2 > NUMJNLBLOCKS) jnlCheckpointLocked();
+
+  bioFlush();                            // data first; pinned blocks stay
+
+  memset(g_stage, 0, BYTESPERBLOCK);
+  JnlBlock* desc = (JnlBlock*)g_stage;
+  desc->magic = JNLMAGIC;
+  desc->type  = JNLDESC;
+  desc->seq   = g_seq;
+  desc->n     = g_n;
+  memcpy(g_stage + sizeof(JnlBlock), g_dbns, g_n * sizeof(i32));
+
+  for (i32 i = 0; i < g_n; ++i) {
+    bioRead(g_dbns[i], g_stage + (i64)(1 + i) * BYTESPERBLOCK);
+  }
+
+  i8* tail = g_stage + (i64)(1 + g_n) * BYTESPERBLOCK;
+  memset(tail, 0, BYTESPERBLOCK);
+  JnlBlock* commit = (JnlBlock*)tail;
+  commit->magic = JNLMAGIC;
+  commit->type  = JNLCOMMIT;
+  commit->seq   = g_seq;
+  commit->n     = g_n;
+  commit->sum   = jnlSum(FNVBASIS, g_stage, (i64)(1 + g_n) * BYTESPERBLOCK);
+
+  bioWriteRange(DBNJNL + g_head, g_n + 2, g_stage);
+  bioSync();
+
+  g_logged[g_head] = g_logged[g_head + g_n + 1] = 0;
+  for (i32 i = 0; i < g_n; ++i) {
+    g_logged[g_head + 1 + i] = g_dbns[i];
+    bioUnpin(g_dbns[i]);
+  }
+  g_head += g_n + 2;
+  ++g_seq;
+  g_n = 0;
+  prfEnd(PRFJNLCOMMIT, t0, (i64)n * BYTESPERBLOCK, n);
+}
+
+
+
+// ============================================================================
+// Wait until the running transaction has room for 'n' blocks beyond those
+// reserved, and no jnlPause is held.  If no operation is in progress, a
+// transaction too full to make room is committed.  Caller holds g_lock
+// ============================================================================
+static void jnlAdmit(i32 n) {
+  if (n > g_cap) FATAL(EJNLFULL);
+  while (g_paused || g_n + g_reserved + n > g_cap) {
+    if (!g_paused && g_active == 0) {
+      jnlCommitLocked();
+    } else {
+      pthread_cond_wait(&g_opCond, &g_lock);
+    }
+  }
+}
+
+
+
+// ============================================================================
+// Check that the transaction whose descriptor is in 'desc', at log block
+// 'pos', committed intact as transaction 'seq'.  Its copies are read one
+// block at a time into 'buf'.  Return 1 if so, else 0
+// ============================================================================
+static i32 jnlIntact(JnlBlock* desc, i32 pos, i32 seq, i8* buf) {
+  if (desc->magic != JNLMAGIC || desc->type != JNLDESC)  return 0;
+  if (desc->seq != seq)                                  return 0;
+  if (desc->n < 1 || desc->n > jnlMaxBlocks())           return 0;
+  if (pos + desc->n + 2 > NUMJNLBLOCKS)                  return 0;
+
+  u32 sum = jnlSum(FNVBASIS, (i8*)desc, BYTESPERBLOCK);
+  for (i32 i = 1; i <= desc->n; ++i) {
+    bioReadRange(DBNJNL + pos + i, 1, buf);
+    sum = jnlSum(sum, buf, BYTESPERBLOCK);
+  }
+
+  bioReadRange(DBNJNL + pos + desc->n + 1, 1, buf);
+  JnlBlock* commit = (JnlBlock*)buf;
+  if (commit->magic != JNLMAGIC || commit->type != JNLCOMMIT) return 0;
+  if (commit->seq != seq || commit->n != desc->n)            return 0;
+  return commit->sum == sum;
+}
+
+
+
+// ============================================================================
+// Start an operation on this thread: a set of metadata changes that commit
+// together.  Waits for room for JNLOPBLOCKS blocks in the running
+// transaction.  The caller may hold the Inode lock of the file it changes,
+// but no other lock.  Safe to call if the journal is not open
+// ============================================================================
+i32 jnlBegin() {
+  pthread_mutex_lock(&g_lock);
+  if (g_open) {
+    i32 n = (JNLOPBLOCKS < g_cap) ? JNLOPBLOCKS : g_cap;
+    jnlAdmit(n);
+    ++g_active;
+    g_reserved += n;
+    t_op    = 1;
+    t_res   = n;
+    t_wrote = 0;
+  }
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Empty the log, so that no committed copy of any block can be replayed
+// over it.  Needed before a freed metadata block is handed out again.  Safe
+// to call if the journal is not open
+// ============================================================================
+i32 jnlCheckpoint() {
+  pthread_mutex_lock(&g_lock);
+  if (g_open) jnlCheckpointLocked();
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Commit the running transaction, checkpoint the log, and stop journaling.
+// Metadata writes go straight to the cache again.  Safe to call if the
+// journal is not open
+// ============================================================================
+i32 jnlClose() {
+  pthread_mutex_lock(&g_lock);
+  if (g_open) {
+    jnlCommitLocked();
+    jnlCheckpointLocked();
+    free(g_dbns);   g_dbns   = NULL;
+    free(g_stage);  g_stage  = NULL;
+    free(g_logged); g_logged = NULL;
+    g_open = 0;
+  }
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Commit the running transaction to the log.  The caller holds jnlPause, or
+// knows no operation is in progress.  On success, return 0
+// ============================================================================
+i32 jnlCommit() {
+  pthread_mutex_lock(&g_lock);
+  jnlCommitLocked();
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// End this thread's operation.  Its changes may now commit, and its unused
+// reservation goes back to the running transaction
+// ============================================================================
+i32 jnlEnd() {
+  pthread_mutex_lock(&g_lock);
+  if (t_op) {
+    g_reserved -= t_res;
+    --g_active;
+    t_op = t_res = t_wrote = 0;
+    pthread_cond_broadcast(&g_opCond);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Drop block 'dbn' from the running transaction, if it is there: it has been
+// freed, so its contents must not be committed over its next owner.  The
+// block is unpinned.  Caller holds jnlPause
+// ============================================================================
+i32 jnlForget(i32 dbn) {
+  pthread_mutex_lock(&g_lock);
+  for (i32 i = 0; g_open && i < g_n; ++i) {
+    if (g_dbns[i] != dbn) continue;
+    memmove(&g_dbns[i], &g_dbns[i + 1], (g_n - i - 1) * sizeof(i32));
+    --g_n;
+    bioUnpin(dbn);
+    break;
+  }
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return 1 if the running transaction is half full, so the caller should
+// commit at the end of its operation, else 0
+// ============================================================================
+i32 jnlFull() {
+  pthread_mutex_lock(&g_lock);
+  i32 full = g_open && g_n >= g_cap / 2;
+  pthread_mutex_unlock(&g_lock);
+  return full;
+}
+
+
+
+// ============================================================================
+// Write the head block of a new, empty journal.  Called by fsFormat
+// ============================================================================
+i32 jnlInit() {
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  JnlBlock* jb = (JnlBlock*)buf;
+  jb->magic = JNLMAGIC;
+  jb->type  = JNLHEAD;
+  jb->seq   = 1;
+  return bioWrite(DBNJNL, buf);
+}
+
+
+
+// ============================================================================
+// Start journaling the mounted disk.  First replay, into their home blocks,
+// the transactions in the log that committed intact, in sequence order;
+// replay stops at the first torn or stale one.  The log then restarts
+// empty.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 jnlOpen() {
+  i8 desc[BYTESPERBLOCK];
+  i8 buf[BYTESPERBLOCK];
+
+  bioReadRange(DBNJNL, 1, desc);
+  JnlBlock* head = (JnlBlock*)desc;
+  if (head->magic != JNLMAGIC || head->type != JNLHEAD) FATAL(EBADJNL);
+
+  i32 seq = head->seq;
+  i32 pos = 1;
+  i32 replayed = 0;
+
+  while (pos + 2 <= NUMJNLBLOCKS) {
+    bioReadRange(DBNJNL + pos, 1, desc);
+    if (!jnlIntact((JnlBlock*)desc, pos, seq, buf)) break;
+
+    i32  n    = ((JnlBlock*)desc)->n;
+    i32* dbns = (i32*)(desc + sizeof(JnlBlock));
+    for (i32 i = 0; i < n; ++i) {
+      if (dbns[i] <= DBNSUPER || dbns[i] >= BLOCKSPERDISK) FATAL(EBADJNL);
+      bioReadRange(DBNJNL + pos + 1 + i, 1, buf);
+      bioWriteRange(dbns[i], 1, buf);
+    }
+    pos += n + 2;
+    ++seq;
+    ++replayed;
+  }
+  if (replayed > 0) bioSync();
+
+  // The running transaction may hold up to 'g_cap' blocks, leaving at
+  // least half the buffer cache unpinned
+
+  g_cap = jnlMaxBlocks();
+  if (g_cap > bioCacheBlocks() / 2) g_cap = bioCacheBlocks() / 2;
+  if (g_cap < 1) g_cap = 1;
+
+  free(g_dbns);
+  free(g_stage);
+  free(g_logged);
+  g_dbns   = malloc(g_cap * sizeof(i32));
+  g_stage  = malloc((i64)(g_cap + 2) * BYTESPERBLOCK);
+  g_logged = calloc(NUMJNLBLOCKS, sizeof(i32));
+  if (g_dbns == NULL || g_stage == NULL || g_logged == NULL) FATAL(ENOMEM);
+
+  g_n    = 0;
+  g_seq  = seq;
+  g_open = 1;
+  jnlWriteHead(g_seq);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Wait for every operation in progress to end, and hold off new ones until
+// jnlResume, so the caller can commit a transaction that holds only whole
+// operations.  The caller must not be in an operation itself
+// ============================================================================
+i32 jnlPause() {
+  pthread_mutex_lock(&g_lock);
+  while (g_paused) pthread_cond_wait(&g_opCond, &g_lock);
+  g_paused = 1;
+  t_paused = 1;
+  while (g_active > 0) pthread_cond_wait(&g_opCond, &g_lock);
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make sure this thread's operation may add 'n' more blocks to the running
+// transaction, keeping one back for its Inodes block.  If there is no room,
+// an operation that has written nothing yet waits, as jnlBegin does; one
+// that has must end where it is, as it may not be split across a commit.
+// Return 1 if the room is there, or 0 if the operation must end
+// ============================================================================
+i32 jnlReserve(i32 n) {
+  pthread_mutex_lock(&g_lock);
+  i32 need = n + 1 - t_res;
+  i32 ok   = 1;
+  if (t_op && need > 0) {
+    if (g_n + g_reserved + need <= g_cap) {
+      g_reserved += need;
+      t_res      += need;
+    } else if (t_wrote == 0) {            // leave, and come back in
+      g_reserved -= t_res;
+      --g_active;
+      pthread_cond_broadcast(&g_opCond);
+      jnlAdmit(n + 1);
+      ++g_active;
+      g_reserved += n + 1;
+      t_res       = n + 1;
+    } else {
+      ok = 0;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+  return ok;
+}
+
+
+
+// ============================================================================
+// Let operations start again, after jnlPause
+// ============================================================================
+i32 jnlResume() {
+  pthread_mutex_lock(&g_lock);
+  g_paused = 0;
+  t_paused = 0;
+  pthread_cond_broadcast(&g_opCond);
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write metadata block 'dbn' from 'buf' as part of the running transaction.
+// The block stays pinned in the cache until committed.  A transaction never
+// fills up inside an operation that kept to its reservation; one that
+// fills up while jnlPause is held commits on the spot.  When the journal is
+// not open, this is a plain bioWrite
+// ============================================================================
+i32 jnlWrite(i32 dbn, void* buf) {
+  i64 t0 = prfBegin(PRFJNLWRITE);
+  pthread_mutex_lock(&g_lock);
+  if (!g_open) {
+    bioWrite(dbn, buf);
+  } else {
+    i32 i = 0;
+    if (g_n >= g_cap) {
+      while (i < g_n && g_dbns[i] != dbn) ++i;   // already in it is fine
+      if (i == g_n && t_paused) jnlCommitLocked();
+      else if (i == g_n)        FATAL(EJNLFULL);
+    }
+    if (bioPin(dbn, buf) > g_n) {                // newly pinned
+      g_dbns[g_n++] = dbn;
+      if (t_res > 0) { --t_res; --g_reserved; }
+    }
+    t_wrote += t_op;
+  }
+  pthread_mutex_unlock(&g_lock);
+  prfEnd(PRFJNLWRITE, t0, BYTESPERBLOCK, 1);
+  return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef JNL_H
+#define JNL_H
+
+// ===================================================================
+// jnl.h - write-ahead journal of BFS metadata blocks
+// ===================================================================
+
+#include "alias.h"
+
+#define JNLMAGIC      0x4A4E4C31  // "JNL1"
+
+#define JNLHEAD       1           // JnlBlock types
+#define JNLDESC       2
+#define JNLCOMMIT     3
+
+#define JNLOPBLOCKS   6           // blocks reserved for each operation
+
+// The journal region starts with a head block, naming the sequence number
+// of the first transaction in the log.  The log follows it: each committed
+// transaction is a descriptor block, listing the home DBNs of its blocks,
+// then a copy of each block, then a commit block holding a checksum over
+// the descriptor and copies
+
+typedef struct {          // start of every journal head/descriptor/commit
+  u32 magic;              // JNLMAGIC
+  i32 type;               // JNLHEAD, JNLDESC or JNLCOMMIT
+  i32 seq;                // transaction sequence number
+  i32 n;                  // # of blocks in the transaction
+  u32 sum;                // JNLCOMMIT: checksum of descriptor and copies
+} JnlBlock;
+
+i32 jnlBegin ();
+i32 jnlCheckpoint();
+i32 jnlClose ();
+i32 jnlCommit();
+i32 jnlEnd   ();
+i32 jnlForget(i32 dbn);
+i32 jnlFull  ();
+i32 jnlInit  ();
+i32 jnlOpen  ();
+i32 jnlPause ();
+i32 jnlReserve(i32 n);
+i32 jnlResume();
+i32 jnlWrite (i32 dbn, void* buf);
+
+#endif
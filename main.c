@@ -1,11 +1,14 @@
 #include <stdio.h>
 
-#include "bfs.h"
+#include "bfstest.h"
 #include "errors.h"
+#include "fs.h"
 #include "p5test.h"
 
 int main() {
-  bfsInitOFT();
+  fsMount();
   p5test();
+  fsUnmount();
+  bfstest();
   return 0;
 }
\ No newline at end of file
@@ -5,6 +5,9 @@
 
 #include "p5test.h"
 
+static char g_scratch[64];          // scratch directory, see scratchIn
+static char g_home[4096];           // directory to return to
+
 // ============================================================================
 // Check that 'size' bytes, starting at buf[start] hold the value 'val'.
 // 'testnum' is the test number - used for reporting
@@ -36,6 +39,51 @@ void checkCursor(int testnum, int expected, int actual) {
 
 
 
+// ============================================================================
+// Check that 'actual' == 'expected' for test 'testnum'.  'what' names the
+// value - used for reporting
+// ============================================================================
+void checkEqual(i32 testnum, str what, i32 expected, i32 actual) {
+  if (actual == expected) {
+    printf("TEST %d : GOOD \n", testnum);
+  } else {
+    printf("TEST %d : BAD  : %s = %d but should be %d \n", 
+        testnum, what, actual, expected);
+  }
+}
+
+
+
+// ============================================================================
+// Move into a fresh scratch directory, so a test can format a BFS disk of
+// its own there and leave BFSDISK, with "P5" on it, alone
+// ============================================================================
+void scratchIn() {
+  strcpy(g_scratch, "/tmp/p5testXXXXXX");
+  assert(getcwd(g_home, sizeof(g_home)) != NULL);
+  assert(mkdtemp(g_scratch) != NULL);
+  assert(chdir(g_scratch) == 0);
+}
+
+
+
+// ============================================================================
+// Remove the scratch disk, and its striped images, then go back to the
+// directory scratchIn left
+// ============================================================================
+void scratchOut() {
+  char name[32];
+  unlink("BFSDISK");
+  for (int i = 1; i < 16; ++i) {
+    sprintf(name, "BFSDISK.%d", i);
+    unlink(name);
+  }
+  assert(chdir(g_home) == 0);
+  rmdir(g_scratch);
+}
+
+
+
 // ============================================================================
 // Create file "P5", holding 50 blocks, inside of BFSDISK, and populate
 // ============================================================================
@@ -236,6 +284,336 @@ void test6(i32 fd) {
 
 
 
+// ============================================================================
+// TEST 7 : Crash after commit.  On a scratch disk, a child process writes
+//          two interleaved files (so each needs Extent blocks), fsFsync's
+//          as it goes, truncates one, deletes the other, writes again and
+//          fsFsync's, then exits without fsUnmount.  Remounting replays
+//          the journal: every change committed must be there
+//          512*0, 512*1, 2000*7 ; "B" gone
+// ============================================================================
+void test7() {
+  static i8 buf[2 * BYTESPERBLOCK + BUFSIZE];
+
+  scratchIn();
+  fsFormat(2000, BYTESPERBLOCK, 32);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    fsMount();
+    i32 a = fsCreate("A");
+    i32 b = fsCreate("B");
+    for (int k = 0; k < 40; ++k) {  // the log fills, and is checkpointed
+      memset(buf, k, BYTESPERBLOCK);
+      fsWrite(a, BYTESPERBLOCK, buf);
+      fsWrite(b, BYTESPERBLOCK, buf);
+      fsFsync(a);
+    }
+    fsTruncate(a, 2 * BYTESPERBLOCK);    // frees the indirect Extent block
+    fsClose(b);
+    fsDelete("B");
+
+    fsSeek(a, 2 * BYTESPERBLOCK, SEEK_SET);
+    memset(buf, 7, BUFSIZE);
+    fsWrite(a, BUFSIZE, buf);
+    fsFsync(a);
+    _exit(0);                             // crash: no fsClose, no fsUnmount
+  }
+  assert(pid > 0);
+  waitpid(pid, NULL, 0);
+
+  fsMount();
+  i32 a = fsOpen("A");
+  checkEqual(7, "size", 2 * BYTESPERBLOCK + BUFSIZE, fsSize(a));
+
+  memset(buf, -1, sizeof(buf));
+  fsRead(a, 2 * BYTESPERBLOCK + BUFSIZE, buf);
+  i32 bad = -1;                           // first block read wrongly
+  for (int k = 0; k < 2 && bad < 0; ++k) {
+    for (int i = 0; i < BYTESPERBLOCK; ++i) {
+      if (buf[k * BYTESPERBLOCK + i] != k) { bad = k; break; }
+    }
+  }
+  checkEqual(7, "first bad block", -1, bad);
+  check(7, buf, 2 * BYTESPERBLOCK, BUFSIZE, 7);
+  checkEqual(7, "fsOpen(\"B\")", EFNF, fsOpen("B"));
+  fsClose(a);
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 8 : Asynchronous IO.  On a scratch disk, 4 workers run 16 tagged
+//          writes of 1000 bytes; every completion is collected, each tag
+//          once.  The same is done for 16 reads of what was written
+//          1000*k for k = 1..16, in any order
+// ============================================================================
+void test8() {
+  static i8 data[16][1000];
+  static i8 back[16][1000];
+  AsyReq  req[16];
+  AsyDone done[16];
+
+  scratchIn();
+  fsFormat(1000, BYTESPERBLOCK, 8);
+  fsMount();
+  i32 fd = fsCreate("ASY");
+  asyInit(4);
+
+  i32 ops[2] = {ASYWRITE, ASYREAD};      // write, then read back
+  for (int pass = 0; pass < 2; ++pass) {
+    i32 op = ops[pass];
+    for (int k = 0; k < 16; ++k) {
+      memset(data[k], k + 1, 1000);
+      req[k].op     = op;
+      req[k].fd     = fd;
+      req[k].numb   = 1000;
+      req[k].offset = k * 1000;
+      req[k].buf    = (op == ASYWRITE) ? data[k] : back[k];
+      req[k].tag    = k;
+    }
+    checkEqual(8, "# submitted", 16, asySubmit(req, 16));
+    checkEqual(8, "# completed", 16, asyWait(done, 16, 16));
+
+    u32 seen = 0;                         // bit k => tag k completed
+    i32 bad  = 0;                         // # of unexpected completions
+    for (int k = 0; k < 16; ++k) {
+      if (done[k].op != op)                               ++bad;
+      if (done[k].ret != ((op == ASYWRITE) ? 0 : 1000))   ++bad;
+      seen |= 1u << done[k].tag;
+    }
+    checkEqual(8, "tags seen", 0xFFFF, seen);
+    checkEqual(8, "bad completions", 0, bad);
+  }
+
+  checkEqual(8, "size", 16000, fsSize(fd));
+  checkEqual(8, "memcmp", 0, memcmp(data, back, sizeof(data)));
+  asyClose();
+  fsClose(fd);
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 9 : Striping.  A scratch disk is striped over 3 image files, 4
+//          blocks at a time.  300 blocks, then 700 more bytes, are written,
+//          the disk is remounted, and all of it read back
+//          512*(b % 100 + 1) for block b = 0..299, 700*101
+// ============================================================================
+void test9() {
+  static i8 data[300 * BYTESPERBLOCK + 700];
+  static i8 back[300 * BYTESPERBLOCK + 700];
+  i32 size = sizeof(data);
+
+  for (int b = 0; b < 300; ++b) {
+    memset(data + b * BYTESPERBLOCK, b % 100 + 1, BYTESPERBLOCK);
+  }
+  memset(data + 300 * BYTESPERBLOCK, 101, 700);
+
+  scratchIn();
+  fsStripe(3, 4);
+  fsFormat(3000, BYTESPERBLOCK, 16);
+  fsStripe(1, 1);                         // later formats are not striped
+  checkEqual(9, "access(\"BFSDISK.1\")", 0, access("BFSDISK.1", F_OK));
+  checkEqual(9, "access(\"BFSDISK.2\")", 0, access("BFSDISK.2", F_OK));
+
+  fsMount();
+  i32 fd = fsCreate("STRIPED");
+  fsWrite(fd, 300 * BYTESPERBLOCK, data);
+  fsWrite(fd, 700, data + 300 * BYTESPERBLOCK);
+  fsClose(fd);
+  fsUnmount();
+
+  fsMount();
+  fd = fsOpen("STRIPED");
+  checkEqual(9, "size", size, fsSize(fd));
+  checkEqual(9, "bytes read", size, fsRead(fd, size, back));
+  i32 bad = -1;                           // first byte read wrongly
+  for (int i = 0; i < size && bad < 0; ++i) {
+    if (back[i] != data[i]) bad = i;
+  }
+  checkEqual(9, "first bad byte", -1, bad);
+  fsClose(fd);
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 13 : Cursors.  On a scratch disk, a file of 4 blocks is opened on a
+//           second descriptor.  fsPread and fsPwrite leave the cursor
+//           where fsSeek put it, and fsRead on one descriptor moves its
+//           cursor alone
+//           cursors 100, 100, 0, 300, 150 ; 50*2 ; 300*1 ; 50*1
+// ============================================================================
+void test13() {
+  i8 buf[4 * BYTESPERBLOCK];
+
+  scratchIn();
+  fsFormat(1000, BYTESPERBLOCK, 8);
+  fsMount();
+
+  i32 fd1 = fsCreate("CURSORS");
+  for (int b = 0; b < 4; ++b) {
+    memset(buf + b * BYTESPERBLOCK, b + 1, BYTESPERBLOCK);
+  }
+  fsWrite(fd1, sizeof(buf), buf);
+  fsSeek(fd1, 100, SEEK_SET);
+
+  memset(buf, 0, sizeof(buf));
+  fsPread(fd1, 50, buf, 600);
+  check(13, buf, 0, 50, 2);
+  checkCursor(13, 100, fsTell(fd1));
+
+  memset(buf, 9, 10);
+  fsPwrite(fd1, 10, buf, 1500);
+  checkCursor(13, 100, fsTell(fd1));
+
+  i32 fd2 = fsOpen("CURSORS");
+  checkCursor(13, 0, fsTell(fd2));
+  memset(buf, 0, sizeof(buf));
+  fsRead(fd2, 300, buf);
+  check(13, buf, 0, 300, 1);
+  checkCursor(13, 300, fsTell(fd2));
+
+  memset(buf, 0, sizeof(buf));
+  fsRead(fd1, 50, buf);
+  check(13, buf, 0, 50, 1);
+  checkCursor(13, 150, fsTell(fd1));
+  checkCursor(13, 300, fsTell(fd2));
+
+  fsClose(fd2);
+  fsClose(fd1);
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 14 : Many files.  On a scratch disk with room for 4096 files, 3000
+//           are created, spread over many Directory blocks, each holding
+//           its own number.  Every third is deleted, and the disk is
+//           remounted.  Each name deleted is gone; each other opens on the
+//           file holding its number
+//           1000 deleted ; 2000 found with the right contents
+// ============================================================================
+void test14() {
+  char name[16];
+
+  scratchIn();
+  fsFormat(8000, BYTESPERBLOCK, 4096);
+  fsMount();
+
+  for (i32 k = 0; k < 3000; ++k) {        // the OFT is small: close each
+    sprintf(name, "F%04d", k);
+    i32 fd = fsCreate(name);
+    fsWrite(fd, sizeof(k), &k);
+    fsClose(fd);
+  }
+  for (i32 k = 0; k < 3000; k += 3) {
+    sprintf(name, "F%04d", k);
+    fsDelete(name);
+  }
+  fsUnmount();
+
+  fsMount();
+  i32 gone  = 0;                          // names no longer found
+  i32 found = 0;                          // names found, holding their k
+  for (i32 k = 0; k < 3000; ++k) {
+    sprintf(name, "F%04d", k);
+    i32 fd = fsOpen(name);
+    if (fd == EFNF) {
+      gone += (k % 3 == 0);
+      continue;
+    }
+    i32 back = -1;
+    fsRead(fd, sizeof(back), &back);
+    found += (k % 3 != 0 && back == k);
+    fsClose(fd);
+  }
+  checkEqual(14, "# deleted", 1000, gone);
+  checkEqual(14, "# found", 2000, found);
+  fsUnmount();
+
+  scratchOut();
+}
+
+
+
+// ============================================================================
+// TEST 18 : Trace round trip.  On a scratch disk, 12 fs* calls are recorded
+//           from fsFormat to fsUnmount.  The trace holds a record for each,
+//           fsFormat first.  Replayed, every call returns what it did when
+//           recorded, and the file written holds replay's fixed pattern
+//           12 records ; 12 calls, 0 differ ; size 1000 ; 1000*'T'
+// ============================================================================
+void test18() {
+  i8 buf[BUFSIZE];
+
+  scratchIn();
+  trcStart("TRACE");
+  fsFormat(1000, BYTESPERBLOCK, 8);
+  fsMount();
+  i32 fd = fsCreate("TRACED");
+  memset(buf, 1, 1000);
+  fsWrite(fd, 1000, buf);
+  fsSeek(fd, 0, SEEK_SET);
+  fsRead(fd, 600, buf);
+  fsSize(fd);
+  fsClose(fd);
+  fd = fsOpen("TRACED");
+  fsPread(fd, 300, buf, 900);
+  fsClose(fd);
+  fsUnmount();
+  trcStop();
+
+  FILE* fp = fopen("TRACE", "rb");
+  assert(fp != NULL);
+  TrcHead head;
+  TrcRec  rec;
+  assert(fread(&head, sizeof(head), 1, fp) == 1);
+  i32 recs  = 0;
+  i32 first = -1;                         // op of the first record
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    if (recs++ == 0) first = rec.op;
+    if (rec.op == TRCCREATE || rec.op == TRCDELETE || rec.op == TRCOPEN) {
+      fseek(fp, head.nameSize, SEEK_CUR);
+    }
+  }
+  fclose(fp);
+  checkEqual(18, "# records", 12, recs);
+  checkEqual(18, "first op", TRCFORMAT, first);
+
+  TrcStats st;
+  trcReplay("TRACE", 0, &st);
+  checkEqual(18, "# replayed", 12, (i32)st.calls);
+  checkEqual(18, "# differ", 0, (i32)st.differ);
+
+  fsMount();
+  fd = fsOpen("TRACED");
+  checkEqual(18, "size", 1000, fsSize(fd));
+  memset(buf, 0, sizeof(buf));
+  fsRead(fd, 1000, buf);
+  check(18, buf, 0, 1000, 'T');
+  fsClose(fd);
+  fsUnmount();
+
+  unlink("TRACE");
+  scratchOut();
+}
+
+
+
 void p5test() {
 
   i32 fd = fsOpen("P5");    // open "P5" for testing
@@ -249,4 +627,16 @@ void p5test() {
 
   fsClose(fd);
 
+  // The tests below format scratch disks of their own, one at a time, so
+  // the P5 disk is unmounted meanwhile
+
+  fsUnmount();
+  test7();
+  test8();
+  test9();
+  test13();
+  test14();
+  test18();
+  fsMount();
+
 }
@@ -3,10 +3,15 @@
 
 #include <assert.h>       // assert
 #include <stdio.h>        // fopen, printf, 
+#include <stdlib.h>       // mkdtemp
 #include <string.h>       // memset
+#include <sys/wait.h>     // waitpid
+#include <unistd.h>       // fork, chdir, _exit, access
 
 #include "alias.h"        // i32, etc
+#include "asy.h"          // asySubmit, etc
 #include "fs.h"           // fsOpen, etc
+#include "trc.h"          // trcStart, etc
 
 #define BLOCKS        50
 #define BYTESPERBLOCK 512
@@ -14,11 +19,20 @@
 
 void check(i32 testnum, i8* buf, i32 start, i32 size, i32 val);
 void checkCursor(i32 testnum, i32 expected, i32 actual);
+void checkEqual(i32 testnum, str what, i32 expected, i32 actual);
 void createP5();
+void scratchIn();
+void scratchOut();
 void test1(i32 fd);
 void test2(i32 fd);
 void test3(i32 fd);
 void test4(i32 fd);
+void test7();
+void test8();
+void test9();
+void test13();
+void test14();
+void test18();
 void p5test();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,315 @@
+// ============================================================================
+// prf.c - performance counters and latency histograms
+//
+// Each instrumented function brackets its body with prfBegin/prfEnd, which
+// count the call, its bytes and blocks, and its latency in a log2 bucketed
+// histogram.  Each thread keeps a small stack of the operations it is
+// inside, so bio* calls, cache hits and misses, and disk IO are charged to
+// every enclosing operation: the fsRead line shows how many bio* calls
+// one fsRead makes, and how many blocks it moves.  Each thread counts into
+// a shard of its own, so bumping a counter takes no lock and no atomic
+// read-modify-write; readers sum the shards.  Reading the clock is most of
+// the cost, so prfEnable(PRFCOUNT) keeps the counters but skips latencies;
+// prfEnable(PRFOFF) leaves just one load per bracket
+// ============================================================================
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "prf.h"
+
+#define NUMCOUNTERS ((i32)(sizeof(PrfStats) / sizeof(u64)))  // per op
+
+typedef struct Shard {    // one thread's counters
+  PrfStats stats[PRFNUMOPS];
+  struct Shard* next;     // next shard in 'g_shards'
+} Shard;
+
+static i32    g_level = PRFTIME;          // what to count, see prfEnable
+static Shard* g_shards = NULL;            // every thread's shard, ever
+static PrfStats g_base[PRFNUMOPS];        // sums at the last prfReset
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards list
+
+static __thread Shard* t_shard = NULL;    // this thread's counters
+static __thread i32    t_ops[PRFDEPTH];   // operations this thread is inside
+static __thread i32    t_depth = 0;       // # of them, maybe > PRFDEPTH
+
+static str g_names[PRFNUMOPS] = {
+  "fsClose", "fsCreate", "fsDelete", "fsFsync", "fsOpen", "fsPread",
+  "fsPwrite", "fsRead", "fsSeek", "fsSync", "fsTruncate", "fsWrite",
+  "bfsAllocBlocks", "bfsCommit", "bfsRead", "bfsReadAhead", "bfsReadRange",
+  "bfsSyncInode", "bfsTruncate", "bfsWrite", "bfsWriteRange",
+  "jnlCommit", "jnlWrite",
+  "bioFlush", "bioRead", "bioReadAhead", "bioReadRange", "bioSync",
+  "bioWrite", "bioWriteRange",
+  "devRead", "devWrite"
+};
+
+// ============================================================================
+// Nanoseconds since some fixed point, from the monotonic clock.  Never 0
+// or 1, which prfBegin returns when not timing
+// ============================================================================
+static i64 nsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec + 2;
+}
+
+
+
+// ============================================================================
+// Add 'n' to counter '*p' in this thread's shard.  Only this thread writes
+// it, so a plain load and store will do; they are atomic so that readers
+// in other threads see whole values
+// ============================================================================
+static void bump(u64* p, u64 n) {
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+
+
+// ============================================================================
+// Sum the counters of operation 'op' over every shard into 'out'.  Caller
+// holds g_lock
+// ============================================================================
+static void sum(i32 op, u64* out) {
+  memset(out, 0, sizeof(PrfStats));
+  for (Shard* sh = g_shards; sh != NULL; sh = sh->next) {
+    u64* src = (u64*)&sh->stats[op];
+    for (i32 i = 0; i < NUMCOUNTERS; ++i) {
+      out[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+
+// ============================================================================
+// Return this thread's shard, made and listed on first use
+// ============================================================================
+static Shard* shard() {
+  if (t_shard != NULL) return t_shard;
+  t_shard = calloc(1, sizeof(Shard));
+  if (t_shard == NULL) FATAL(ENOMEM);
+  pthread_mutex_lock(&g_lock);
+  t_shard->next = g_shards;
+  g_shards = t_shard;
+  pthread_mutex_unlock(&g_lock);
+  return t_shard;
+}
+
+
+
+// ============================================================================
+// Add 'n' to the counter at byte offset 'off' in the PrfStats of every
+// operation this thread is inside
+// ============================================================================
+static void charge(size_t off, u64 n) {
+  i32 depth = (t_depth < PRFDEPTH) ? t_depth : PRFDEPTH;
+  Shard* sh = shard();
+  for (i32 i = 0; i < depth; ++i) {
+    bump((u64*)((i8*)&sh->stats[t_ops[i]] + off), n);
+  }
+}
+
+
+
+// ============================================================================
+// Start timing a call of operation 'op'.  A bio* call counts against each
+// operation it is nested in.  Return the start time, to pass to prfEnd; 1
+// if latencies are not being taken, or 0 if counting is off
+// ============================================================================
+i64 prfBegin(i32 op) {
+  i32 level = __atomic_load_n(&g_level, __ATOMIC_RELAXED);
+  if (level == PRFOFF) return 0;
+  if (op < 0 || op >= PRFNUMOPS) FATAL(EBADPRF);
+
+  if (op >= PRFBIOFLUSH && op <= PRFBIOWRITERANGE) {
+    charge(offsetof(PrfStats, bioCalls), 1);
+  }
+  if (t_depth < PRFDEPTH) t_ops[t_depth] = op;
+  ++t_depth;
+  return (level == PRFTIME) ? nsNow() : 1;
+}
+
+
+
+// ============================================================================
+// Charge 'hits' buffer cache hits and 'misses' misses to every operation
+// this thread is inside
+// ============================================================================
+i32 prfCache(i32 hits, i32 misses) {
+  if (t_depth == 0) return 0;
+  if (hits   > 0) charge(offsetof(PrfStats, hits),   hits);
+  if (misses > 0) charge(offsetof(PrfStats, misses), misses);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Charge the disk IO of 'n' blocks starting at 'dbn' to every operation
+// this thread is inside, split into metadata and data blocks
+// ============================================================================
+i32 prfDev(i32 dbn, i32 n) {
+  if (t_depth == 0) return 0;
+  i32 meta = (dbn < NUMMETA) ? NUMMETA - dbn : 0;
+  if (meta > n) meta = n;
+  if (meta > 0)     charge(offsetof(PrfStats, metaIO), meta);
+  if (n - meta > 0) charge(offsetof(PrfStats, dataIO), n - meta);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Count nothing (PRFOFF), just the counters (PRFCOUNT), or the counters
+// and latencies too (PRFTIME).  Counts so far are kept.  On success,
+// return 0
+// ============================================================================
+i32 prfEnable(i32 level) {
+  if (level < PRFOFF || level > PRFTIME) FATAL(EBADPRF);
+  __atomic_store_n(&g_level, level, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Finish timing the call of operation 'op' begun at 't0', which asked for
+// or moved 'bytes' bytes in 'blocks' blocks
+// ============================================================================
+i32 prfEnd(i32 op, i64 t0, i64 bytes, i64 blocks) {
+  if (t0 == 0) return 0;                  // begun while counting was off
+  if (op < 0 || op >= PRFNUMOPS) FATAL(EBADPRF);
+
+  --t_depth;
+  PrfStats* s = &shard()->stats[op];
+  bump(&s->calls,  1);
+  bump(&s->bytes,  bytes);
+  bump(&s->blocks, blocks);
+  if (t0 == 1) return 0;                  // not timed
+
+  u64 ns = nsNow() - t0;
+  i32 b  = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+  if (b >= PRFBUCKETS) b = PRFBUCKETS - 1;
+  bump(&s->ns,      ns);
+  bump(&s->hist[b], 1);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the counters of every operation to 'fp' as CSV (PRFCSV: a header
+// line, then one line per operation) or JSON (PRFJSON: one object holding
+// an array of operations).  Latencies are in nanoseconds.  On success,
+// return 0
+// ============================================================================
+i32 prfExport(FILE* fp, i32 format) {
+  if (fp == NULL) FATAL(ENULLPTR);
+  if (format != PRFCSV && format != PRFJSON) FATAL(EBADPRF);
+
+  if (format == PRFCSV) {
+    fprintf(fp, "op,calls,ns,bytes,blocks,bio_calls,hits,misses,"
+                "meta_io,data_io,p50_ns,p99_ns");
+    for (i32 b = 0; b < PRFBUCKETS; ++b) fprintf(fp, ",h%d", b);
+    fprintf(fp, "\n");
+  } else {
+    fprintf(fp, "{\"buckets\": %d, \"ops\": [\n", PRFBUCKETS);
+  }
+
+  for (i32 op = 0; op < PRFNUMOPS; ++op) {
+    PrfStats s;
+    prfGet(op, &s);
+    str fmt = (format == PRFCSV)
+      ? "%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu"
+      : "  {\"op\": \"%s\", \"calls\": %lu, \"ns\": %lu, \"bytes\": %lu, "
+        "\"blocks\": %lu, \"bio_calls\": %lu, \"hits\": %lu, "
+        "\"misses\": %lu, \"meta_io\": %lu, \"data_io\": %lu, "
+        "\"p50_ns\": %lu, \"p99_ns\": %lu, \"hist\": [";
+    fprintf(fp, fmt, prfName(op), s.calls, s.ns, s.bytes, s.blocks,
+      s.bioCalls, s.hits, s.misses, s.metaIO, s.dataIO,
+      prfPercentile(&s, 50), prfPercentile(&s, 99));
+
+    for (i32 b = 0; b < PRFBUCKETS; ++b) {
+      str sep = (format == PRFCSV || b > 0) ? "," : "";
+      fprintf(fp, "%s%lu", sep, s.hist[b]);
+    }
+    if (format == PRFCSV) fprintf(fp, "\n");
+    else fprintf(fp, "]}%s\n", (op + 1 < PRFNUMOPS) ? "," : "");
+  }
+
+  if (format == PRFJSON) fprintf(fp, "]}\n");
+  fflush(fp);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the counters of operation 'op', counted since the last prfReset,
+// into 'stats'.  On success, return 0
+// ============================================================================
+i32 prfGet(i32 op, PrfStats* stats) {
+  if (op < 0 || op >= PRFNUMOPS) FATAL(EBADPRF);
+  if (stats == NULL)             FATAL(ENULLPTR);
+
+  u64* dst  = (u64*)stats;
+  u64* base = (u64*)&g_base[op];
+  pthread_mutex_lock(&g_lock);
+  sum(op, dst);
+  for (i32 i = 0; i < NUMCOUNTERS; ++i) dst[i] -= base[i];
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Name of operation 'op', as the function it counts is called
+// ============================================================================
+str prfName(i32 op) {
+  if (op < 0 || op >= PRFNUMOPS) FATAL(EBADPRF);
+  return g_names[op];
+}
+
+
+
+// ============================================================================
+// Return a bound, in nanoseconds, that 'pct' percent of the calls counted in
+// 'stats' took no longer than: the top of the histogram bucket where they
+// reach 'pct' percent.  0 if no calls were timed
+// ============================================================================
+u64 prfPercentile(PrfStats* stats, i32 pct) {
+  if (stats == NULL)         FATAL(ENULLPTR);
+  if (pct < 0 || pct > 100)  FATAL(EBADPRF);
+
+  u64 timed = 0;                          // calls counted with PRFTIME
+  for (i32 b = 0; b < PRFBUCKETS; ++b) timed += stats->hist[b];
+
+  u64 want = (timed * pct + 99) / 100;
+  u64 seen = 0;
+  for (i32 b = 0; b < PRFBUCKETS; ++b) {
+    seen += stats->hist[b];
+    if (seen >= want && seen > 0) return (b == 0) ? 0 : (1ULL << b) - 1;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Start the counters of every operation again from zero.  The shards are
+// left alone, being written by their threads: the sums so far become the
+// base that prfGet subtracts.  On success, return 0
+// ============================================================================
+i32 prfReset() {
+  pthread_mutex_lock(&g_lock);
+  for (i32 op = 0; op < PRFNUMOPS; ++op) sum(op, (u64*)&g_base[op]);
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
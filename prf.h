@@ -0,0 +1,87 @@
+#ifndef PRF_H
+#define PRF_H
+
+// ===================================================================
+// prf.h - performance counters and latency histograms for the fs*,
+// bfs*, jnl* and bio* layers
+// ===================================================================
+
+#include <stdio.h>
+
+#include "alias.h"
+
+#define PRFBUCKETS    40          // latency histogram buckets, see PrfStats
+#define PRFDEPTH      8           // most nested operations charged per thread
+
+#define PRFOFF        0           // prfEnable levels: count nothing
+#define PRFCOUNT      1           //   counters only: no clock reads
+#define PRFTIME       2           //   counters and latencies (the default)
+
+#define PRFCSV        1           // prfExport formats
+#define PRFJSON       2
+
+#define PRFFSCLOSE         0      // operations counted
+#define PRFFSCREATE        1
+#define PRFFSDELETE        2
+#define PRFFSFSYNC         3
+#define PRFFSOPEN          4
+#define PRFFSPREAD         5
+#define PRFFSPWRITE        6
+#define PRFFSREAD          7
+#define PRFFSSEEK          8
+#define PRFFSSYNC          9
+#define PRFFSTRUNCATE     10
+#define PRFFSWRITE        11
+#define PRFBFSALLOC       12      // bfsAllocBlocks
+#define PRFBFSCOMMIT      13
+#define PRFBFSREAD        14
+#define PRFBFSREADAHEAD   15
+#define PRFBFSREADRANGE   16
+#define PRFBFSSYNCINODE   17
+#define PRFBFSTRUNCATE    18
+#define PRFBFSWRITE       19
+#define PRFBFSWRITERANGE  20
+#define PRFJNLCOMMIT      21
+#define PRFJNLWRITE       22
+#define PRFBIOFLUSH       23      // bioFlush and bioFlushRange
+#define PRFBIOREAD        24
+#define PRFBIOREADAHEAD   25
+#define PRFBIOREADRANGE   26
+#define PRFBIOSYNC        27
+#define PRFBIOWRITE       28
+#define PRFBIOWRITERANGE  29
+#define PRFDEVREAD        30      // syscalls that read the disk
+#define PRFDEVWRITE       31      // syscalls that write the disk
+#define PRFNUMOPS         32
+
+// An operation is charged with what happens inside it, however deeply
+// nested: the bio* calls it makes, the cache hits and misses they see, and
+// the blocks they move to and from the disk.  Blocks in the fixed regions
+// before the first data block (Super, Inodes, bitmap, Directory, journal)
+// count as metadata IO; all others count as data IO
+
+typedef struct {          // counters for one operation
+  u64 calls;              // # of calls
+  u64 ns;                 // total time spent in them
+  u64 bytes;              // bytes asked for, or moved
+  u64 blocks;             // blocks asked for, or moved
+  u64 bioCalls;           // bio* calls made inside them
+  u64 hits;               // blocks found in the buffer cache
+  u64 misses;             // blocks not found in the buffer cache
+  u64 metaIO;             // metadata blocks read or written on the disk
+  u64 dataIO;             // data blocks read or written on the disk
+  u64 hist[PRFBUCKETS];   // [b]: # of calls taking 2^(b-1) .. 2^b - 1 ns
+} PrfStats;
+
+i64 prfBegin  (i32 op);
+i32 prfCache  (i32 hits, i32 misses);
+i32 prfDev    (i32 dbn, i32 n);
+i32 prfEnable (i32 level);
+i32 prfEnd    (i32 op, i64 t0, i64 bytes, i64 blocks);
+i32 prfExport (FILE* fp, i32 format);
+i32 prfGet    (i32 op, PrfStats* stats);
+str prfName   (i32 op);
+u64 prfPercentile(PrfStats* stats, i32 pct);
+i32 prfReset  ();
+
+#endif
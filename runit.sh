@@ -2,6 +2,6 @@
 
 rm -f a.out
 
-gcc -Wall -Wextra -Wno-sign-compare *.c
+gcc -pthread -Wall -Wextra -Wno-sign-compare *.c
 
 ./a.out
@@ -0,0 +1,338 @@
+// ============================================================================
+// trc.c - recording and replay of fs* call traces
+//
+// Each fs* call brackets its body with trcBegin/trcEnd.  While a trace is
+// being recorded, trcEnd appends a record of the call - its arguments,
+// result, start time and duration - to the trace file, under one mutex;
+// stdio buffers the writes, and fsSync, fsFsync and fsUnmount flush them.
+// When no trace is being recorded, trcBegin is one load and trcEnd returns
+// at once.  Setting BFSTRACE to a path records a trace of an unmodified
+// program, from its first fsFormat or fsMount.
+//
+// trcReplay makes a trace's calls again, one at a time, in the order they
+// returned, mapping each recorded file descriptor to the one handed out
+// now.  Calls made on many threads are thus replayed as one serial stream
+// ============================================================================
+
+#include <pthread.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "fs.h"
+#include "trc.h"
+
+#define NUMTIDS  (UINT8_MAX + 1)           // thread #s a record can hold
+#define ANYTID   NUMTIDS                   // fdOf map row for any thread
+
+static i32   g_on    = 0;                 // 1 => recording a trace
+static FILE* g_fp    = NULL;              // trace being recorded
+static i64   g_start = 0;                 // nsNow at trcStart
+static i32   g_gen   = 0;                 // bumped by each trcStart
+static i32   g_nextTid = 0;               // next thread # in this trace
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards trace
+static pthread_once_t  g_envOnce = PTHREAD_ONCE_INIT;
+
+static __thread i32 t_gen = 0;            // trace 't_tid' was handed out in
+static __thread i32 t_tid = 0;            // this thread's # in that trace
+
+// ============================================================================
+// Start recording to the trace file named by BFSTRACE, if it is set
+// ============================================================================
+static void envStart() {
+  str path = getenv(TRCENV);
+  if (path != NULL && path[0] != '\0') trcStart(path);
+}
+
+
+
+// ============================================================================
+// Return the slot for descriptor 'fd' in a row of the fd map, or -1 if it
+// is not a descriptor fsOpen could hand out
+// ============================================================================
+static i32 fdSlot(i32 fd) {
+  i32 slot = fd - FIRSTFD;
+  return (slot >= 0 && slot < NUMFDTENTRIES) ? slot : -1;
+}
+
+
+
+// ============================================================================
+// Return the descriptor handed out now for descriptor 'fd', as recorded by
+// thread 'tid'.  'map' has a row of NUMFDTENTRIES for each thread, then one
+// row, ANYTID, for the latest mapping made by any thread, each indexed by
+// fdSlot; -1 => none.  A thread's own row comes first: calls are recorded
+// as they return, so one thread may open a recorded fd before another's
+// close of it shows up
+// ============================================================================
+static i32 fdOf(i32* map, i32 tid, i32 fd) {
+  i32 slot = fdSlot(fd);
+  if (slot < 0) return fd;
+  i32* own = map + (i64)tid    * NUMFDTENTRIES;
+  i32* any = map + (i64)ANYTID * NUMFDTENTRIES;
+  if (own[slot] >= 0) return own[slot];
+  if (any[slot] >= 0) return any[slot];
+  return fd;
+}
+
+
+
+// ============================================================================
+// Return 1 if the record of call 'op' is followed by a file name, else 0
+// ============================================================================
+static i32 hasName(i32 op) {
+  return op == TRCCREATE || op == TRCDELETE || op == TRCOPEN;
+}
+
+
+
+// ============================================================================
+// Nanoseconds since some fixed point, from the monotonic clock.  Never 0,
+// which trcBegin returns when not recording
+// ============================================================================
+static i64 nsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec + 1;
+}
+
+
+
+// ============================================================================
+// Make the call recorded in 'r' again.  'name' holds its file name, if it
+// has one, and 'buf' has room for its bytes.  Return what the call returns
+// ============================================================================
+static i32 replayOne(TrcRec* r, str name, i32* map, i8* buf) {
+  i32 fd = fdOf(map, r->tid, r->arg[0]);
+  switch (r->op) {
+    case TRCCLOSE:    return fsClose(fd);
+    case TRCCREATE:   return fsCreate(name);
+    case TRCDELETE:   return fsDelete(name);
+    case TRCFORMAT:   return fsFormat(r->arg[0], r->arg[1], r->arg[2]);
+    case TRCFSYNC:    return fsFsync(fd);
+    case TRCMOUNT:    return fsMount();
+    case TRCOPEN:     return fsOpen(name);
+    case TRCPREAD:    return fsPread(fd, r->arg[1], buf, r->arg[2]);
+    case TRCPWRITE:   return fsPwrite(fd, r->arg[1], buf, r->arg[2]);
+    case TRCREAD:     return fsRead(fd, r->arg[1], buf);
+    case TRCSEEK:     return fsSeek(fd, r->arg[1], r->arg[2]);
+    case TRCSIZE:     return fsSize(fd);
+    case TRCSYNC:     return fsSync();
+    case TRCTELL:     return fsTell(fd);
+    case TRCTRUNCATE: return fsTruncate(fd, r->arg[1]);
+    case TRCUNMOUNT:  return fsUnmount();
+    case TRCWRITE:    return fsWrite(fd, r->arg[1], buf);
+    case TRCSTRIPE:   return fsStripe(r->arg[0], r->arg[1]);
+  }
+  FATAL(EBADTRC);
+  return EBADTRC;
+}
+
+
+
+// ============================================================================
+// Sleep until nsNow reaches 'ns'
+// ============================================================================
+static void waitUntil(i64 ns) {
+  --ns;                                   // undo nsNow's offset
+  struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {}
+}
+
+
+
+// ============================================================================
+// Start timing an fs* call.  Return the value to hand trcEnd: 0 if no trace
+// is being recorded
+// ============================================================================
+i64 trcBegin() {
+  if (!__atomic_load_n(&g_on, __ATOMIC_RELAXED)) return 0;
+  return nsNow();
+}
+
+
+
+// ============================================================================
+// Record call 'op', begun when trcBegin returned 't0', which returned
+// 'ret'.  'fname' is its file name, or NULL, and 'a0' .. 'a2' its integer
+// arguments, 0 for those it lacks.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 trcEnd(i32 op, i64 t0, str fname, i32 a0, i32 a1, i32 a2, i32 ret) {
+  if (t0 == 0) return 0;
+  i64 ns = nsNow() - t0;
+
+  TrcRec r;
+  memset(&r, 0, sizeof(TrcRec));
+  r.op     = op;
+  r.arg[0] = a0;
+  r.arg[1] = a1;
+  r.arg[2] = a2;
+  r.ret    = ret;
+  r.ns     = ns > UINT32_MAX ? UINT32_MAX : ns;
+
+  char name[FNAMESIZE];
+  memset(name, 0, FNAMESIZE);
+  if (fname != NULL) strncpy(name, fname, FNAMESIZE - 1);
+
+  pthread_mutex_lock(&g_lock);
+  if (g_fp != NULL) {                     // not stopped since trcBegin
+    if (t_gen != g_gen) { t_gen = g_gen; t_tid = g_nextTid++; }
+    r.tid = t_tid > UINT8_MAX ? UINT8_MAX : t_tid;
+    r.t   = t0 > g_start ? t0 - g_start : 0;
+
+    i32 ok = fwrite(&r, sizeof(TrcRec), 1, g_fp) == 1;
+    if (ok && hasName(op)) ok = fwrite(name, FNAMESIZE, 1, g_fp) == 1;
+    if (ok && (op == TRCSYNC || op == TRCFSYNC || op == TRCUNMOUNT)) {
+      ok = fflush(g_fp) == 0;
+    }
+    if (!ok) { pthread_mutex_unlock(&g_lock); FATAL(EBADTRC); }
+  }
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Start recording to the file named by environment variable BFSTRACE, if it
+// is set.  Only the first call in a process does anything.  Called by
+// fsFormat, fsMount and fsStripe
+// ============================================================================
+i32 trcEnv() {
+  pthread_once(&g_envOnce, envStart);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make the calls recorded in trace file 'path' again, against BFSDISK.  If
+// the trace does not start with fsFormat, fsMount or fsStripe (which comes
+// before an fsFormat), the disk is mounted
+// first, so it may be a copy of the disk as it was when recording began.
+// With 'paced' set, each call waits until as long after the first as it
+// did when recorded; otherwise calls run back to back.  A disk left
+// mounted is unmounted.  Fills in 'stats', if not NULL.  On success, return
+// 0.  On failure, abort
+// ============================================================================
+i32 trcReplay(str path, i32 paced, TrcStats* stats) {
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) FATAL(EBADTRC);
+
+  TrcHead head;
+  if (fread(&head, sizeof(TrcHead), 1, fp) != 1) FATAL(EBADTRC);
+  if (head.magic != TRCMAGIC || head.nameSize != FNAMESIZE) FATAL(EBADTRC);
+
+  i64 mapSize = (i64)(NUMTIDS + 1) * NUMFDTENTRIES;
+  i32* map = malloc(mapSize * sizeof(i32));
+  if (map == NULL) FATAL(ENOMEM);
+  for (i64 i = 0; i < mapSize; ++i) map[i] = -1;
+
+  i8* buf = NULL;                         // data for reads and writes
+  i32 cap = 0;                            // bytes in 'buf'
+  i32 mounted = -1;                       // -1 => no call replayed yet
+  TrcStats st;
+  memset(&st, 0, sizeof(TrcStats));
+
+  i64 start = nsNow();
+  TrcRec r;
+  char name[FNAMESIZE];
+  while (fread(&r, sizeof(TrcRec), 1, fp) == 1) {
+    if (r.op >= TRCNUMOPS) FATAL(EBADTRC);
+    if (hasName(r.op) && fread(name, FNAMESIZE, 1, fp) != 1) FATAL(EBADTRC);
+    name[FNAMESIZE - 1] = '\0';
+
+    if (mounted == -1) {
+      mounted = 0;
+      if (r.op != TRCFORMAT && r.op != TRCMOUNT && r.op != TRCSTRIPE) {
+        fsMount();
+        mounted = 1;
+      }
+    }
+
+    i32 numb = 0;
+    if (r.op == TRCPREAD || r.op == TRCPWRITE || r.op == TRCREAD ||
+        r.op == TRCWRITE) numb = r.arg[1];
+    if (numb > cap) {
+      free(buf);
+      buf = malloc(numb);
+      if (buf == NULL) FATAL(ENOMEM);
+      memset(buf, 'T', numb);
+      cap = numb;
+    }
+
+    if (paced) waitUntil(start + (i64)r.t);
+    i32 ret = replayOne(&r, name, map, buf);
+
+    i32 slot = fdSlot(r.ret);             // map recorded fd to this one
+    if ((r.op == TRCCREATE || r.op == TRCOPEN) && r.ret >= 0 && ret >= 0) {
+      if (slot >= 0) {
+        map[(i64)r.tid  * NUMFDTENTRIES + slot] = ret;
+        map[(i64)ANYTID * NUMFDTENTRIES + slot] = ret;
+      }
+      ret = r.ret;                        // the same file, maybe another fd
+    }
+    slot = fdSlot(r.arg[0]);              // forget a closed fd's mapping
+    if (r.op == TRCCLOSE && slot >= 0) {
+      map[(i64)r.tid * NUMFDTENTRIES + slot] = -1;
+    }
+    if (r.op == TRCMOUNT)   mounted = 1;
+    if (r.op == TRCUNMOUNT) mounted = 0;
+
+    ++st.calls;
+    if (ret != r.ret) ++st.differ;
+    if ((i64)r.t + r.ns > st.traceNs) st.traceNs = (i64)r.t + r.ns;
+  }
+
+  if (mounted == 1) fsUnmount();
+  st.ns = nsNow() - start;
+  free(map);
+  free(buf);
+  fclose(fp);
+  if (stats != NULL) *stats = st;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Start recording every fs* call to a new trace file 'path', replacing any
+// trace being recorded.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 trcStart(str path) {
+  trcStop();
+
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) FATAL(EBADTRC);
+
+  TrcHead head;
+  memset(&head, 0, sizeof(TrcHead));
+  head.magic    = TRCMAGIC;
+  head.nameSize = FNAMESIZE;
+  if (fwrite(&head, sizeof(TrcHead), 1, fp) != 1) FATAL(EBADTRC);
+
+  pthread_mutex_lock(&g_lock);
+  g_fp      = fp;
+  g_start   = nsNow();
+  g_nextTid = 0;
+  ++g_gen;
+  __atomic_store_n(&g_on, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Stop recording, and close the trace file.  Safe to call if no trace is
+// being recorded.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 trcStop() {
+  pthread_mutex_lock(&g_lock);
+  __atomic_store_n(&g_on, 0, __ATOMIC_RELAXED);
+  FILE* fp = g_fp;
+  g_fp = NULL;
+  pthread_mutex_unlock(&g_lock);
+
+  if (fp != NULL && fclose(fp) != 0) FATAL(EBADTRC);
+  return 0;
+}
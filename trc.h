@@ -0,0 +1,67 @@
+#ifndef TRC_H
+#define TRC_H
+
+// ===================================================================
+// trc.h - recording and replay of fs* call traces
+// ===================================================================
+
+#include "alias.h"
+
+#define TRCMAGIC      0x54524331  // "TRC1"
+#define TRCENV        "BFSTRACE"  // env var naming a trace file to record
+
+#define TRCCLOSE       0          // calls traced
+#define TRCCREATE      1
+#define TRCDELETE      2
+#define TRCFORMAT      3
+#define TRCFSYNC       4
+#define TRCMOUNT       5
+#define TRCOPEN        6
+#define TRCPREAD       7
+#define TRCPWRITE      8
+#define TRCREAD        9
+#define TRCSEEK       10
+#define TRCSIZE       11
+#define TRCSYNC       12
+#define TRCTELL       13
+#define TRCTRUNCATE   14
+#define TRCUNMOUNT    15
+#define TRCWRITE      16
+#define TRCSTRIPE     17          // fsStripe, added after the rest
+#define TRCNUMOPS     18
+
+// A trace file is a TrcHead, then one TrcRec per call, in the order the
+// calls returned.  The record of an fsCreate, fsDelete or fsOpen is followed
+// by the file name, in 'nameSize' bytes.  Data read and written is not
+// recorded; replay writes a fixed pattern
+
+typedef struct {          // start of a trace file
+  u32 magic;              // TRCMAGIC
+  i32 nameSize;           // bytes per file name, FNAMESIZE
+} TrcHead;
+
+typedef struct {          // one traced call
+  u8  op;                 // TRCCLOSE .. TRCSTRIPE
+  u8  tid;                // calling thread, numbered in order of first call
+  u16 pad;
+  i32 arg[3];             // integer arguments, in order.  Unused ones are 0
+  i32 ret;                // what the call returned
+  u32 ns;                 // how long it took, at most UINT32_MAX
+  u64 t;                  // when it started, in ns since trcStart
+} TrcRec;
+
+typedef struct {          // what trcReplay did
+  i64 calls;              // # of calls replayed
+  i64 differ;             // # of them that returned other than recorded
+  i64 ns;                 // time taken to replay them
+  i64 traceNs;            // time the recorded calls spanned
+} TrcStats;
+
+i64 trcBegin ();
+i32 trcEnd   (i32 op, i64 t0, str fname, i32 a0, i32 a1, i32 a2, i32 ret);
+i32 trcEnv   ();
+i32 trcReplay(str path, i32 paced, TrcStats* stats);
+i32 trcStart (str path);
+i32 trcStop  ();
+
+#endif